@@ -0,0 +1,209 @@
+// Measures the front end and code generation on a large synthetic Iron
+// program: lexing, parsing into the flat syntax tree, resolving names, and
+// generating LLVM IR into an in-memory module. Then measures the same program compiled lazily,
+// where main only reaches one function in a hundred. Last, measures compiling
+// it into an object file on 1, 2, 4 and so on up to max threads.
+//
+// usage: bench_compile [function count] [iterations] [max threads]
+
+// standard includes
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// iron includes
+#include "iron/generate.h"
+#include "iron/lex.h"
+#include "iron/parse.h"
+#include "iron/resolve.h"
+
+using Clock = std::chrono::steady_clock;
+using File = iron::File;
+using String = std::string;
+template<typename Ttype>
+using Shared = std::shared_ptr<Ttype>;
+
+/// @brief Writes @p count functions that code generation supports to a
+///   temporary file and returns its path. Each function calls the one before
+///   it, so every call resolves. main calls one function a hundredth of the
+///   way along the chain.
+String writeCorpus(size_t count)
+{
+  char path[] = "/tmp/iron_bench_compile_XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    iron::errorln("Could not create a temporary file for the corpus.");
+    exit(-1);
+  }
+
+  String corpus;
+  for (size_t i=0; i<count; ++i)
+  {
+    const auto n = std::to_string(i);
+    corpus += "fn func" + n + ": () => (code: i32)\n{\n";
+    if (i == 0)
+    {
+      corpus += "  ret 0;\n}\n\n";
+    }
+    else
+    {
+      corpus += "  ret (func" + std::to_string(i - 1) + "() / " + n + ":i32) / 3;\n}\n\n";
+    }
+  }
+  corpus += "fn main: () => (code: i32)\n{\n  ret func" + std::to_string(count / 100) +
+    "();\n}\n";
+
+  const auto written = write(fd, corpus.data(), corpus.size());
+  close(fd);
+  if (written != static_cast<ssize_t>(corpus.size()))
+  {
+    iron::errorln("Could not write the corpus to ", String{path});
+    exit(-1);
+  }
+  return path;
+}
+
+double secondsSince(Clock::time_point start)
+{
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t count = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 100000;
+  const size_t iterations = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 3;
+  const size_t maxThreads = (argc > 3) ? strtoul(argv[3], nullptr, 10) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  const auto path = writeCorpus(count);
+  auto file = std::make_shared<File>(path);
+
+  double bestLex = 0.0;
+  double bestParse = 0.0;
+  double bestResolve = 0.0;
+  double bestGenerate = 0.0;
+  double bestLazyParse = 0.0;
+  double bestLazyGenerate = 0.0;
+  size_t tokenCount = 0;
+  size_t nodeCount = 0;
+  for (size_t i=0; i<iterations; ++i)
+  {
+    auto start = Clock::now();
+    auto tokens = iron::lex(file);
+    const double lexTime = secondsSince(start);
+    tokenCount = tokens.count();
+    if (tokenCount == 0)
+    {
+      iron::errorln("Failed to lex the corpus in ", path);
+      return -1;
+    }
+
+    start = Clock::now();
+    iron::ast::Tree tree;
+    if (!iron::ast::parse(tokens.all(), tree))
+    {
+      iron::errorln("Failed to parse the corpus in ", path);
+      return -1;
+    }
+    const double parseTime = secondsSince(start);
+    nodeCount = tree.count();
+
+    start = Clock::now();
+    if (!iron::ast::resolve(tree))
+    {
+      iron::errorln("Failed to resolve the names in the corpus in ", path);
+      return -1;
+    }
+    const double resolveTime = secondsSince(start);
+
+    start = Clock::now();
+    llvm::LLVMContext context;
+    auto module = new iron::Module("Iron Benchmark", context);
+    iron::Unit unit{module};
+    if (!iron::generate(tree, unit))
+    {
+      iron::errorln("Failed to generate code for the corpus in ", path);
+      return -1;
+    }
+    const double generateTime = secondsSince(start);
+    delete module;
+
+    start = Clock::now();
+    iron::ast::Tree lazyTree;
+    if (!iron::ast::parseSignatures(tokens.all(), lazyTree))
+    {
+      iron::errorln("Failed to parse the signatures of the corpus in ", path);
+      return -1;
+    }
+    const double lazyParseTime = secondsSince(start);
+
+    start = Clock::now();
+    module = new iron::Module("Iron Benchmark", context);
+    iron::Unit lazyUnit{module};
+    if (!iron::generateFromMain(lazyTree, tokens, lazyUnit))
+    {
+      iron::errorln("Failed to generate code from main for the corpus in ", path);
+      return -1;
+    }
+    const double lazyGenerateTime = secondsSince(start);
+    delete module;
+
+    if (i == 0 || lexTime < bestLex) { bestLex = lexTime; }
+    if (i == 0 || parseTime < bestParse) { bestParse = parseTime; }
+    if (i == 0 || resolveTime < bestResolve) { bestResolve = resolveTime; }
+    if (i == 0 || generateTime < bestGenerate) { bestGenerate = generateTime; }
+    if (i == 0 || lazyParseTime < bestLazyParse) { bestLazyParse = lazyParseTime; }
+    if (i == 0 || lazyGenerateTime < bestLazyGenerate)
+    {
+      bestLazyGenerate = lazyGenerateTime;
+    }
+  }
+
+  printf("%zu functions, %zu tokens, %zu nodes, best of %zu:\n", count,
+    tokenCount, nodeCount, iterations);
+  printf("  lex      %8.1f ms (%.2f Mtokens/s)\n", bestLex * 1e3,
+    tokenCount / bestLex / 1e6);
+  printf("  parse    %8.1f ms (%.2f Mnodes/s)\n", bestParse * 1e3,
+    nodeCount / bestParse / 1e6);
+  printf("  resolve  %8.1f ms (%.2f Mnodes/s)\n", bestResolve * 1e3,
+    nodeCount / bestResolve / 1e6);
+  printf("  generate %8.1f ms (%.2f Mnodes/s)\n", bestGenerate * 1e3,
+    nodeCount / bestGenerate / 1e6);
+  printf("lazily, reaching %zu functions from main:\n", count / 100 + 2);
+  printf("  parse    %8.1f ms (signatures only)\n", bestLazyParse * 1e3);
+  printf("  generate %8.1f ms (bodies parsed on demand)\n", bestLazyGenerate * 1e3);
+
+  auto tokens = iron::lex(file);
+  iron::ast::Tree tree;
+  if (!iron::ast::parse(tokens.all(), tree) || !iron::ast::resolve(tree))
+  {
+    iron::errorln("Failed to parse the corpus in ", path);
+    return -1;
+  }
+  const String objPath = path + ".o";
+  printf("compiled into an object file, with partitions on separate threads:\n");
+  for (size_t threads=1; threads<=maxThreads; threads*=2)
+  {
+    double best = 0.0;
+    for (size_t i=0; i<iterations; ++i)
+    {
+      const auto start = Clock::now();
+      if (!iron::generate(tree, objPath, iron::Emit::object, iron::Optimization{}, threads))
+      {
+        iron::errorln("Failed to compile the corpus in ", path);
+        return -1;
+      }
+      const double time = secondsSince(start);
+      if (i == 0 || time < best) { best = time; }
+    }
+    printf("  %2zu threads %8.1f ms\n", threads, best * 1e3);
+  }
+  unlink(objPath.c_str());
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,92 @@
+// Measures lexer throughput on a large synthetic Iron program, serially and
+// then with every thread count up to the number of cores.
+//
+// usage: bench_lex [function count] [iterations] [max threads]
+
+// standard includes
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// iron includes
+#include "iron/lex.h"
+
+using Clock = std::chrono::steady_clock;
+using File = iron::File;
+using String = std::string;
+template<typename Ttype>
+using Shared = std::shared_ptr<Ttype>;
+
+/// @brief Writes @p count functions shaped like the examples to a temporary
+///   file and returns its path.
+String writeCorpus(size_t count)
+{
+  char path[] = "/tmp/iron_bench_lex_XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    iron::errorln("Could not create a temporary file for the corpus.");
+    exit(-1);
+  }
+
+  String corpus;
+  for (size_t i=0; i<count; ++i)
+  {
+    const auto n = std::to_string(i);
+    corpus += "fn func" + n + ": () => (code: i32)\n{\n";
+    corpus += "  var" + n + ": i32 {" + n + "};\n";
+    corpus += "  ret (func" + n + "() + 4567) * 89 / var" + n + " - 1;\n}\n\n";
+  }
+
+  const auto written = write(fd, corpus.data(), corpus.size());
+  close(fd);
+  if (written != static_cast<ssize_t>(corpus.size()))
+  {
+    iron::errorln("Could not write the corpus to ", String{path});
+    exit(-1);
+  }
+  return path;
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t count = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 200000;
+  const size_t iterations = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 5;
+  const size_t maxThreads = (argc > 3) ? strtoul(argv[3], nullptr, 10) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  const auto path = writeCorpus(count);
+  auto file = std::make_shared<File>(path);
+
+  double serial = 0.0;
+  for (size_t threads=1; threads<=maxThreads; ++threads)
+  {
+    double best = 0.0;
+    size_t tokenCount = 0;
+    for (size_t i=0; i<iterations; ++i)
+    {
+      const auto start = Clock::now();
+      auto tokens = iron::lex(file, threads);
+      const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+      tokenCount = tokens.count();
+      if (tokenCount == 0)
+      {
+        iron::errorln("Failed to lex the corpus in ", path);
+        return -1;
+      }
+      const double rate = tokenCount / elapsed.count();
+      if (rate > best) { best = rate; }
+    }
+    if (threads == 1) { serial = best; }
+
+    const double bytesPerToken = double(file->size()) / tokenCount;
+    printf("lex -j%zu: %zu bytes, %zu tokens, best of %zu: %.2f Mtokens/s "
+      "(%.1f MB/s, %.2fx)\n", threads, file->size(), tokenCount, iterations,
+      best / 1e6, best * bytesPerToken / 1e6, best / serial);
+  }
+  unlink(path.c_str());
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Measures parser throughput on two synthetic Iron programs, serially and
+// then with every thread count up to the number of cores:
+//   wide - many small functions with many short statements each
+//   deep - fewer functions whose return expressions nest parentheses deeply
+//
+// usage: bench_parse [scale] [iterations] [max threads]
+
+// standard includes
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// iron includes
+#include "iron/lex.h"
+#include "iron/parse.h"
+
+using Clock = std::chrono::steady_clock;
+using File = iron::File;
+using String = std::string;
+template<typename Ttype>
+using Shared = std::shared_ptr<Ttype>;
+
+/// @brief Writes @p corpus to a temporary file and returns its path
+String writeCorpus(const String& corpus)
+{
+  char path[] = "/tmp/iron_bench_parse_XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    iron::errorln("Could not create a temporary file for the corpus.");
+    exit(-1);
+  }
+
+  const auto written = write(fd, corpus.data(), corpus.size());
+  close(fd);
+  if (written != static_cast<ssize_t>(corpus.size()))
+  {
+    iron::errorln("Could not write the corpus to ", String{path});
+    exit(-1);
+  }
+  return path;
+}
+
+/// @brief @p count functions of 16 statements that use every statement form
+String wideCorpus(size_t count)
+{
+  String corpus;
+  for (size_t i=0; i<count; ++i)
+  {
+    const auto n = std::to_string(i);
+    corpus += "fn func" + n + ": () => (code: i32)\n{\n";
+    for (size_t j=0; j<5; ++j)
+    {
+      const auto m = std::to_string(j);
+      corpus += "  var" + m + ": i32 {" + m + "};\n";
+      corpus += "  func" + n + "();\n";
+      corpus += "  ptr" + m + ": ()=>(code: i32) { func" + n + " };\n";
+    }
+    corpus += "  ret var0 * 2 - var1 / 3 + func" + n + "();\n}\n\n";
+  }
+  return corpus;
+}
+
+/// @brief @p count functions that each return an expression nested
+///   @p depth parentheses deep
+String deepCorpus(size_t count, size_t depth)
+{
+  String corpus;
+  for (size_t i=0; i<count; ++i)
+  {
+    corpus += "fn func" + std::to_string(i) + ": () => (code: i32)\n{\n  ret ";
+    for (size_t j=0; j<depth; ++j) { corpus += "(1 + "; }
+    corpus += "0";
+    for (size_t j=0; j<depth; ++j) { corpus += ")"; }
+    corpus += ";\n}\n\n";
+  }
+  return corpus;
+}
+
+void run(const char* name, const String& corpus, size_t iterations,
+  size_t maxThreads)
+{
+  const auto path = writeCorpus(corpus);
+  auto file = std::make_shared<File>(path);
+  auto tokens = iron::lex(file);
+  if (tokens.isEmpty())
+  {
+    iron::errorln("Failed to lex the ", name, " corpus in ", path);
+    exit(-1);
+  }
+
+  double serial = 0.0;
+  for (size_t threads=1; threads<=maxThreads; ++threads)
+  {
+    double best = 0.0;
+    size_t nodeCount = 0;
+    for (size_t i=0; i<iterations; ++i)
+    {
+      const auto start = Clock::now();
+      iron::ast::Tree tree;
+      if (!iron::ast::parse(tokens.all(), tree, threads))
+      {
+        iron::errorln("Failed to parse the ", name, " corpus in ", path);
+        exit(-1);
+      }
+      const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+      nodeCount = tree.count();
+      const double rate = tokens.count() / elapsed.count();
+      if (rate > best) { best = rate; }
+    }
+    if (threads == 1) { serial = best; }
+
+    printf("parse %s -j%zu: %zu tokens, %zu nodes, best of %zu: %.2f Mtokens/s "
+      "(%.2fx)\n", name, threads, tokens.count(), nodeCount, iterations,
+      best / 1e6, best / serial);
+  }
+  unlink(path.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t scale = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 20000;
+  const size_t iterations = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 5;
+  const size_t maxThreads = (argc > 3) ? strtoul(argv[3], nullptr, 10) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  run("wide", wideCorpus(scale), iterations, maxThreads);
+  run("deep", deepCorpus(scale / 20, 500), iterations, maxThreads);
+  return 0;
+}
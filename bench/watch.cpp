@@ -0,0 +1,144 @@
+// Measures rebuilding a large synthetic Iron program into an object file
+// after small edits, as iron --watch does: first a build from nothing, then
+// a one-character edit in the body of the middle function, then a new
+// function added in the middle and removed again. Each rebuild prints how
+// many partitions it had to compile.
+//
+// usage: bench_watch [function count] [iterations] [threads]
+
+// standard includes
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// iron includes
+#include "iron/watch.h"
+
+using Clock = std::chrono::steady_clock;
+using String = std::string;
+
+/// @brief The source of @p count functions that code generation supports.
+///   Each function calls the one before it, and the middle one divides by
+///   @p divisor. If @p extra is set, a function that nothing calls is added
+///   in the middle.
+String makeCorpus(size_t count, char divisor, bool extra)
+{
+  String corpus;
+  for (size_t i=0; i<count; ++i)
+  {
+    const auto n = std::to_string(i);
+    if (extra && i == count / 2)
+    {
+      corpus += "fn extra: () => (code: i32)\n{\n  ret 1;\n}\n\n";
+    }
+    corpus += "fn func" + n + ": () => (code: i32)\n{\n";
+    if (i == 0)
+    {
+      corpus += "  ret 0;\n}\n\n";
+    }
+    else
+    {
+      corpus += "  ret (func" + std::to_string(i - 1) + "() / " + n + ":i32) / " +
+        ((i == count / 2) ? divisor : '3') + ";\n}\n\n";
+    }
+  }
+  corpus += "fn main: () => (code: i32)\n{\n  ret func" + std::to_string(count - 1) +
+    "();\n}\n";
+  return corpus;
+}
+
+/// @brief Replaces what is in the file at @p path with @p corpus
+void writeCorpus(const String& path, const String& corpus)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr || fwrite(corpus.data(), 1, corpus.size(), file) != corpus.size())
+  {
+    iron::errorln("Could not write the corpus to ", path);
+    exit(-1);
+  }
+  fclose(file);
+}
+
+double secondsSince(Clock::time_point start)
+{
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+  const size_t count = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 20000;
+  const size_t iterations = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 3;
+  const size_t threads = (argc > 3) ? strtoul(argv[3], nullptr, 10) :
+    std::max(1u, std::thread::hardware_concurrency());
+
+  char dir[] = "/tmp/iron_bench_watch_XXXXXX";
+  if (mkdtemp(dir) == nullptr)
+  {
+    iron::errorln("Could not create a temporary directory for the corpus.");
+    return -1;
+  }
+  const String path = String{dir} + "/watch.iron";
+  const String objPath = String{dir} + "/watch.o";
+
+  iron::SessionOptions options;
+  options.emit = iron::Emit::object;
+  options.jobs = threads;
+  iron::IncrementalBuild build{path, objPath, options};
+
+  writeCorpus(path, makeCorpus(count, '3', false));
+  auto start = Clock::now();
+  if (!build.build())
+  {
+    iron::errorln("Failed to build the corpus in ", path);
+    return -1;
+  }
+  const double fullTime = secondsSince(start);
+
+  double bestEdit = 0.0;
+  double bestInsert = 0.0;
+  for (size_t i=0; i<iterations; ++i)
+  {
+    writeCorpus(path, makeCorpus(count, (i % 2 == 0) ? '7' : '3', false));
+    start = Clock::now();
+    if (!build.build())
+    {
+      iron::errorln("Failed to rebuild the corpus in ", path, " after an edit");
+      return -1;
+    }
+    const double editTime = secondsSince(start);
+
+    writeCorpus(path, makeCorpus(count, (i % 2 == 0) ? '7' : '3', true));
+    start = Clock::now();
+    if (!build.build())
+    {
+      iron::errorln("Failed to rebuild the corpus in ", path, " after an insert");
+      return -1;
+    }
+    const double insertTime = secondsSince(start);
+
+    // Back to the corpus without the new function, so the next insert is one
+    writeCorpus(path, makeCorpus(count, (i % 2 == 0) ? '7' : '3', false));
+    if (!build.build())
+    {
+      iron::errorln("Failed to rebuild the corpus in ", path, " after a removal");
+      return -1;
+    }
+
+    if (i == 0 || editTime < bestEdit) { bestEdit = editTime; }
+    if (i == 0 || insertTime < bestInsert) { bestInsert = insertTime; }
+  }
+
+  printf("%zu functions on %zu threads, best of %zu:\n", count, threads, iterations);
+  printf("  first build        %8.1f ms\n", fullTime * 1e3);
+  printf("  one-character edit %8.1f ms\n", bestEdit * 1e3);
+  printf("  function added     %8.1f ms\n", bestInsert * 1e3);
+
+  unlink(path.c_str());
+  unlink(objPath.c_str());
+  rmdir(dir);
+  return 0;
+}
@@ -1,11 +1,15 @@
 #pragma once
 
 // standard includes
-#include <memory>
+#include <cassert>
+#include <cstdint>
 #include <sstream>
+#include <type_traits>
 
 // iron includes
 #include "iron/darray.h"
+#include "iron/print.h"
+#include "iron/symbol.h"
 #include "iron/token.h"
 
 namespace iron
@@ -14,248 +18,513 @@ namespace iron
 namespace ast
 {
 
-template<typename Ttype>
-using Shared = std::shared_ptr<Ttype>;
-template<typename Ttype>
-using Weak = std::weak_ptr<Ttype>;
-
-struct Node
+enum class Kind : ubyte_t
 {
-  enum class Kind
-  {
-    binary_expr,
-    block,
-    expr_stmnt,
-    float_lit,
-    func_call,
-    func_defn,
-    func_type,
-    int_lit,
-    initializer,
-    lvalue,
-    nspace, // namespace is a reserved word
-    ret_stmnt,
-    tname, // typename is a reserved word
-    var_decl,
-    var_decl_stmnt
-  };
-
-  Node() = delete;
-  Node(Kind k, Pos p) : _pos(p), _kind(k) {}
-
-  Kind kind() const { return _kind; }
-  Pos pos() const { return _pos; }
-
-private :
-  const Pos _pos;
-  const Kind _kind;
+  binary_expr,
+  block,
+  expr_stmnt,
+  float_lit,
+  func_call,
+  func_defn,
+  func_type,
+  int_lit,
+  initializer,
+  lvalue,
+  nspace, // namespace is a reserved word
+  ret_stmnt,
+  tname, // typename is a reserved word
+  var_decl,
+  var_decl_stmnt
 };
+static const size_t KIND_COUNT = size_t(Kind::var_decl_stmnt) + 1;
 
-struct BinExpr : public Node
-{
-  BinExpr(Pos p, Shared<Node> l, Token::Type t) :
-      Node(Kind::binary_expr, p), lhs(l), type(t) {}
-
-  // lhs must not be null
-  Shared<Node> lhs;
-  // rhs must not be null
-  Shared<Node> rhs;
-  // type must be one of: 
-  //     Token::Type::plus
-  //     Token::Type::minus
-  //     Token::Type::asterisk
-  //     Token::Type::fwd_slash
-  Token::Type type;
-};
-
-struct Block : public Node
+/// @brief A reference to a node in a @ref Tree: the node's kind and its index
+///   in the pool for that kind, packed into 32 bits. A default-constructed
+///   Ref refers to nothing and tests false.
+class Ref
 {
 private :
-  Darray<Shared<Node>> _stmnts;
+  static const uint32_t INDEX_BITS = 28;
+  static const uint32_t NONE = ~uint32_t(0);
+
+  uint32_t _bits;
 
 public :
-  Block(Pos p) : Node(Kind::block, p) {}
-  void addStmnt(Shared<Node> stmnt) { _stmnts.pushBack(stmnt); }
-  bool isEmpty() const { return _stmnts.isEmpty(); }
-  auto stmnts() const -> decltype(_stmnts.all()) { return _stmnts.all(); }
-  auto stmnts() -> decltype(_stmnts.all()) { return _stmnts.all(); }
+  /// @brief The largest index a pool can hand out
+  static const uint32_t MAX_INDEX = (uint32_t(1) << INDEX_BITS) - 1;
+  static_assert(KIND_COUNT < (size_t(1) << (32 - INDEX_BITS)),
+    "Every kind must fit above the index bits, with one pattern left for NONE");
+
+  constexpr Ref() : _bits(NONE) {}
+  constexpr Ref(Kind kind, uint32_t index) :
+      _bits((uint32_t(kind) << INDEX_BITS) | index)
+  {}
+
+  Kind kind() const { return static_cast<Kind>(_bits >> INDEX_BITS); }
+  uint32_t index() const { return _bits & MAX_INDEX; }
+  bool isNull() const { return _bits == NONE; }
+
+  explicit operator bool() const { return !isNull(); }
+  bool operator==(Ref rhs) const { return _bits == rhs._bits; }
+  bool operator!=(Ref rhs) const { return _bits != rhs._bits; }
 };
 
-struct ExprStmnt : public Node
+/// @brief A run of Refs stored contiguously in a @ref Tree
+struct List
 {
-  ExprStmnt(Shared<Node> e) : Node(Kind::expr_stmnt, e->pos()), expr(e) {}
-
-  Shared<Node> expr;
+  uint32_t first;
+  uint32_t count;
 };
 
-struct Type : public Node
+/// @brief A run of tokens in the TokenStream that a @ref Tree was parsed from
+struct TokenSpan
 {
-
-protected :
-  /// This constructor is protected because one is not supposed to construct a
-  /// type except through child classes.
-  Type(Kind k, Pos p) : Node(k, p) {}
+  uint32_t first;
+  uint32_t count;
 };
 
-struct NumLit : public Node
+/// @brief How far the nodes and lists of one @ref Tree move when it is
+///   appended to another. Applying it to a Ref or List of the appended tree
+///   gives the one that refers to the same place in the combined tree.
+struct Shift
 {
-  NumLit() = delete;
+  /// @brief The number of nodes of each kind before the appended ones
+  uint32_t nodes[KIND_COUNT];
+  /// @brief The number of list elements before the appended ones
+  uint32_t lists;
 
-  bool isNeg = false;
-  Ascii intPart;
-  Shared<Type> type;
+  Ref operator()(Ref ref) const
+  {
+    if (ref.isNull()) { return ref; }
+    return {ref.kind(), ref.index() + nodes[size_t(ref.kind())]};
+  }
 
-protected :
-  /// This constructor is protected because one is not supposed to construct a
-  /// number literal except through child classes.
-  NumLit(Kind t, Pos p) : Node(t, p) {}
+  List operator()(List list) const { return {list.first + lists, list.count}; }
 };
 
-struct FloatLit : public NumLit
+// The node records below hold no pointers and nothing that needs a
+// destructor, so a whole Tree can be copied or written out as a few flat
+// arrays. Their positions are kept by the Tree, apart from the records.
+
+struct BinExpr
 {
-  FloatLit(Pos p) : NumLit(Kind::int_lit, p) {}
+  static const Kind KIND = Kind::binary_expr;
+
+  // lhs must not be null
+  Ref lhs;
+  // rhs must not be null
+  Ref rhs;
+  // type must be one of:
+  //     Token::Type::plus
+  //     Token::Type::minus
+  //     Token::Type::asterisk
+  //     Token::Type::fwd_slash
+  Token::Type type;
 
-  Ascii floatPart;
+  void shift(const Shift& by) { lhs = by(lhs); rhs = by(rhs); }
 };
 
-struct FuncCall : public Node
+struct Block
 {
-  FuncCall(Pos p) : Node(Kind::func_call, p) {}
+  static const Kind KIND = Kind::block;
 
-  // empty name is never valid
-  Ascii name;
-  // TODO: arguments
+  List stmnts;
+
+  bool isEmpty() const { return stmnts.count == 0; }
+  void shift(const Shift& by) { stmnts = by(stmnts); }
 };
 
-struct Scope : public Node
+struct ExprStmnt
 {
-  Scope(Kind k, Pos p) : Scope(k, p, nullptr) {}
-  Scope(Kind k, Pos p, Shared<Scope> prnt) : Node(k, p), parent(prnt) {}
+  static const Kind KIND = Kind::expr_stmnt;
 
-  // when parent is null, this is the global scope
-  Weak<Node> parent;
-  // should never be empty
-  std::string name;
+  Ref expr;
 
-  std::string mangledName()
-  {
-    return name;
-  }
+  void shift(const Shift& by) { expr = by(expr); }
 };
 
-struct Namespace : public Scope
+struct FloatLit
 {
-  // makes a global namespace
-  Namespace(Pos p) : Namespace(p, nullptr) {}
-  Namespace(Pos p, Shared<Scope> prnt) : Scope(Kind::nspace, p, prnt) {}
+  static const Kind KIND = Kind::float_lit;
 
-  Darray<Shared<Node>> decls;
+  double value;
+  bool isNeg;
+  // a null type means the type is deduced
+  Ref type;
+
+  void shift(const Shift& by) { type = by(type); }
 };
 
-struct VarDecl : public Node
+struct FuncCall
 {
-  VarDecl(Pos p, Ascii n) : Node(Kind::var_decl, p), name(n) {}
+  static const Kind KIND = Kind::func_call;
 
-  // an empty name is invalid
-  Ascii name;
-  // an empty type implies type deduction
-  Shared<Type> type;
+  // empty name is never valid
+  Symbol name;
+  // the FuncDefn or VarDecl that name refers to, null until it is resolved
+  Ref decl;
+  // TODO: arguments
+
+  void shift(const Shift& by) { decl = by(decl); }
 };
 
-struct FuncType : public Type
+struct FuncType
 {
-  FuncType(Pos p) : Type(Kind::func_type, p) {}
+  static const Kind KIND = Kind::func_type;
 
-  // empty ins implies no inputs
-  Darray<Shared<VarDecl>> ins;
+  // empty ins implies no inputs. Every element is a VarDecl.
+  List ins;
 
-  // empty outs implies no outputs
-  Darray<Shared<VarDecl>> outs;
+  // empty outs implies no outputs. Every element is a VarDecl.
+  List outs;
 
-  std::string mangledName()
+  std::string mangledName() const
   {
     std::stringstream ss;
-    ss << "P" << ins.count();
+    ss << "P" << ins.count;
     // TODO: For each in, attach the type info
-    ss << "R" << outs.count();
+    ss << "R" << outs.count;
     // TODO: For each out, attach the type info
     return ss.str();
   }
+
+  void shift(const Shift& by) { ins = by(ins); outs = by(outs); }
 };
 
-struct FuncDefn : public Scope
+struct FuncDefn
 {
-  FuncDefn(Pos p, Shared<Scope> n) : Scope(Kind::func_defn, p, n) {}
+  static const Kind KIND = Kind::func_defn;
 
+  // should never be empty
+  Symbol name;
+  // the enclosing namespace
+  Ref parent;
   // null funcType is never valid
-  Shared<FuncType> funcType;
-  Shared<Block> block;
+  Ref funcType;
+  // null until the body is parsed, when only signatures were parsed up front
+  Ref block;
+  // the tokens of the body, braces included
+  TokenSpan body;
 
-  std::string mangledName()
+  bool isParsed() const { return !block.isNull(); }
+
+  std::string mangledName() const
   {
-    std::stringstream ss;
 #if 0
 // TODO: When mangling works, use this logic to mangle a function name
-    ss << nspace.lock()->mangledName();
-    ss << "F" << name.size();
-    ss.write(&name[0], name.size());
-    ss << funcType->mangledName();
+    std::stringstream ss;
+    const auto text = name.text();
+    ss << nspace.mangledName();
+    ss << "F" << text.size();
+    ss.write(&text[0], text.size());
+    ss << funcType.mangledName();
     return ss.str();
 #endif
-    return {&name.front(), name.size()};
+    return name.str();
+  }
+
+  void shift(const Shift& by)
+  {
+    parent = by(parent);
+    funcType = by(funcType);
+    block = by(block);
   }
 };
 
-struct Typename : public Type
+struct Initializer
 {
-  Typename(Pos p) : Type(Kind::tname, p) {}
+  static const Kind KIND = Kind::initializer;
+
+  List exprs;
+
+  void shift(const Shift& by) { exprs = by(exprs); }
 };
 
-struct Initializer : public Node
+struct IntLit
 {
-private :
-  Darray<Shared<Node>> _exprs;
+  static const Kind KIND = Kind::int_lit;
 
-public :
-  Initializer(Pos p) : Node(Kind::initializer, p) {}
-  void addExpr(Shared<Node> expr) { _exprs.pushBack(expr); }
-  PtrRange<Shared<Node>> exprs() { return _exprs.all(); }
+  uint64_t value;
+  bool isNeg;
+  // a null type means the type is deduced
+  Ref type;
+
+  void shift(const Shift& by) { type = by(type); }
 };
 
-struct IntLit : public NumLit
+struct Lvalue
 {
-  IntLit(Pos p) : NumLit(Kind::int_lit, p) {}
+  static const Kind KIND = Kind::lvalue;
+
+  // an empty name is invalid
+  Symbol name;
+  // the FuncDefn or VarDecl that name refers to, null until it is resolved
+  Ref decl;
+
+  void shift(const Shift& by) { decl = by(decl); }
 };
 
-struct Lvalue : public Node
+struct Namespace
 {
-  Lvalue(Pos p, Ascii n) : Node(Kind::lvalue, p), name(n) {}
+  static const Kind KIND = Kind::nspace;
 
-  // an empty name is invalid
-  Ascii name;
+  // should never be empty
+  Symbol name;
+  // when parent is null, this is the global scope
+  Ref parent;
+  List decls;
+
+  std::string mangledName() const
+  {
+    return name.str();
+  }
+
+  void shift(const Shift& by) { parent = by(parent); decls = by(decls); }
 };
 
-struct RetStmnt : public Node
+struct RetStmnt
 {
-  RetStmnt(Pos p) : Node(Kind::ret_stmnt, p) {}
+  static const Kind KIND = Kind::ret_stmnt;
 
   // A null expr implies a void return;
-  Shared<Node> expr;
+  Ref expr;
 
-  bool isVoid() const { return false == static_cast<bool>(expr); }
+  bool isVoid() const { return expr.isNull(); }
+  void shift(const Shift& by) { expr = by(expr); }
 };
 
-struct VarDeclStmnt : public Node
+struct Typename
 {
-  VarDeclStmnt(Pos p) : Node(Kind::var_decl_stmnt, p) {}
+  static const Kind KIND = Kind::tname;
+
+  void shift(const Shift&) {}
+};
+
+struct VarDecl
+{
+  static const Kind KIND = Kind::var_decl;
+
+  // an empty name is invalid
+  Symbol name;
+  // an empty type implies type deduction
+  Ref type;
+
+  void shift(const Shift& by) { type = by(type); }
+};
+
+struct VarDeclStmnt
+{
+  static const Kind KIND = Kind::var_decl_stmnt;
 
   // an empty variable declaration is invalid
-  Shared<VarDecl> decl;
+  Ref decl;
   // an empty initializer list means default construction
-  Shared<Initializer> initializer;
+  Ref initializer;
+
+  void shift(const Shift& by) { decl = by(decl); initializer = by(initializer); }
+};
+
+/// @brief A whole syntax tree, stored flat.
+///
+/// Every kind of node has its own contiguous pool, and nodes refer to each
+/// other by @ref Ref instead of by pointer, so a traversal walks a handful of
+/// dense arrays. The elements of every @ref List share one array as well.
+/// Releasing the tree frees a fixed number of buffers however large it is.
+class Tree
+{
+private :
+  template<typename Ttype>
+  struct Pool
+  {
+    Darray<Ttype> nodes;
+  };
+
+  /// @brief One pool per record type; a pool is picked out by casting to its
+  ///   base.
+  struct Pools :
+    Pool<BinExpr>, Pool<Block>, Pool<ExprStmnt>, Pool<FloatLit>,
+    Pool<FuncCall>, Pool<FuncDefn>, Pool<FuncType>, Pool<Initializer>,
+    Pool<IntLit>, Pool<Lvalue>, Pool<Namespace>, Pool<RetStmnt>,
+    Pool<Typename>, Pool<VarDecl>, Pool<VarDeclStmnt>
+  {};
+
+  Pools _pools;
+  /// @brief The position of every node, by kind and then by index. Positions
+  ///   are only read to report errors, so they stay out of the hot records.
+  Darray<Pos> _positions[KIND_COUNT];
+  /// @brief The elements of every List
+  Darray<Ref> _lists;
+  /// @brief The elements of the lists being built, innermost list last
+  Darray<Ref> _scratch;
+  Ref _root;
+
+public :
+  /// @brief Gathers the elements of one List. A list nested inside this one
+  ///   is gathered and committed before this one continues, so elements never
+  ///   interleave. Elements that are never committed are dropped.
+  class ListBuilder
+  {
+  private :
+    Tree& _tree;
+    size_t _mark;
+
+  public :
+    explicit ListBuilder(Tree& tree) : _tree(tree), _mark(tree._scratch.count()) {}
+    ListBuilder(const ListBuilder&) = delete;
+    ~ListBuilder() { _tree._scratch.truncate(_mark); }
+
+    void add(Ref element) { _tree._scratch.pushBack(element); }
+    size_t count() const { return _tree._scratch.count() - _mark; }
+
+    /// @brief Moves the gathered elements into the tree
+    List commit()
+    {
+      const List list{uint32_t(_tree._lists.count()), uint32_t(count())};
+      for (size_t i=_mark; i<_tree._scratch.count(); ++i)
+      {
+        _tree._lists.pushBack(_tree._scratch.at(i));
+      }
+      _tree._scratch.truncate(_mark);
+      return list;
+    }
+  };
+
+  /// @brief Adds @p node to the pool for its kind
+  template<typename Ttype>
+  Ref add(Pos pos, const Ttype& node)
+  {
+    static_assert(std::is_trivially_copyable<Ttype>::value,
+      "Node records must stay flat");
+    auto& nodes = pool<Ttype>();
+    if (nodes.count() > Ref::MAX_INDEX)
+    {
+      errorln("Internal Compiler Error: Too many nodes of one kind.");
+      abort();
+    }
+    const Ref ref{Ttype::KIND, uint32_t(nodes.count())};
+    nodes.pushBack(node);
+    _positions[size_t(Ttype::KIND)].pushBack(pos);
+    return ref;
+  }
+
+  /// @pre @p ref refers to a Ttype in this tree
+  template<typename Ttype>
+  Ttype& get(Ref ref)
+  {
+    assert(ref.kind() == Ttype::KIND);
+    return pool<Ttype>().at(ref.index());
+  }
+
+  template<typename Ttype>
+  const Ttype& get(Ref ref) const
+  {
+    assert(ref.kind() == Ttype::KIND);
+    return const_cast<Tree*>(this)->pool<Ttype>().at(ref.index());
+  }
+
+  /// @pre @p ref is not null
+  Pos pos(Ref ref) const { return _positions[size_t(ref.kind())].at(ref.index()); }
+
+  PtrRange<const Ref> list(List list) const
+  {
+    if (list.count == 0) { return {}; }
+    const Ref* first = &_lists.at(list.first);
+    return {first, first + list.count - 1};
+  }
+
+  /// @return the number of nodes of @p kind
+  size_t count(Kind kind) const { return _positions[size_t(kind)].count(); }
+
+  /// @return the number of nodes of every kind
+  size_t count() const
+  {
+    size_t total = 0;
+    for (size_t i=0; i<KIND_COUNT; ++i) { total += _positions[i].count(); }
+    return total;
+  }
+
+  Ref root() const { return _root; }
+  void setRoot(Ref root) { _root = root; }
+
+  /// @return the number of nodes of each kind and of list elements, which is
+  ///   also how far the nodes and lists of a tree appended now would move
+  Shift extent() const
+  {
+    Shift extent;
+    for (size_t i=0; i<KIND_COUNT; ++i)
+    {
+      extent.nodes[i] = uint32_t(_positions[i].count());
+    }
+    extent.lists = uint32_t(_lists.count());
+    return extent;
+  }
+
+  /// @brief Makes room for as many nodes and list elements as @p extent
+  ///   counts, so that appending trees up to that size does not reallocate
+  void reserve(const Shift& extent)
+  {
+    reservePools<BinExpr, Block, ExprStmnt, FloatLit, FuncCall, FuncDefn,
+      FuncType, Initializer, IntLit, Lvalue, Namespace, RetStmnt, Typename,
+      VarDecl, VarDeclStmnt>(extent);
+    for (size_t i=0; i<KIND_COUNT; ++i) { _positions[i].reserve(extent.nodes[i]); }
+    _lists.reserve(extent.lists);
+  }
+
+  /// @brief Copies every node and list of @p other to the end of this tree.
+  ///   The root of @p other is not carried over.
+  /// @return how the Refs and Lists of @p other moved
+  Shift append(const Tree& other)
+  {
+    const Shift by = extent();
+    for (size_t i=0; i<KIND_COUNT; ++i)
+    {
+      if (count(Kind(i)) + other.count(Kind(i)) > size_t(Ref::MAX_INDEX) + 1)
+      {
+        errorln("Internal Compiler Error: Too many nodes of one kind.");
+        abort();
+      }
+      _positions[i].append(other._positions[i]);
+    }
+
+    appendPools<BinExpr, Block, ExprStmnt, FloatLit, FuncCall, FuncDefn,
+      FuncType, Initializer, IntLit, Lvalue, Namespace, RetStmnt, Typename,
+      VarDecl, VarDeclStmnt>(other, by);
+
+    for (size_t i=0; i<other._lists.count(); ++i)
+    {
+      _lists.pushBack(by(other._lists.at(i)));
+    }
+    return by;
+  }
+
+private :
+  template<typename Ttype>
+  Darray<Ttype>& pool() { return static_cast<Pool<Ttype>&>(_pools).nodes; }
+
+  template<typename Ttype>
+  void appendPool(const Tree& other, const Shift& by)
+  {
+    auto& nodes = pool<Ttype>();
+    const auto first = nodes.count();
+    nodes.append(static_cast<const Pool<Ttype>&>(other._pools).nodes);
+    for (size_t i=first; i<nodes.count(); ++i) { nodes.at(i).shift(by); }
+  }
+
+  template<typename... Ttypes>
+  void appendPools(const Tree& other, const Shift& by)
+  {
+    const int expand[] = {(appendPool<Ttypes>(other, by), 0)...};
+    (void) expand;
+  }
+
+  template<typename... Ttypes>
+  void reservePools(const Shift& extent)
+  {
+    const int expand[] = {(pool<Ttypes>().reserve(extent.nodes[size_t(Ttypes::KIND)]), 0)...};
+    (void) expand;
+  }
 };
 
 } // namespace ast
 
 } // namespace iron
-
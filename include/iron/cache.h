@@ -0,0 +1,353 @@
+#pragma once
+
+// standard includes
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// system includes
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// iron includes
+#include "iron/print.h"
+#include "iron/range.h"
+#include "iron/types.h"
+
+namespace iron
+{
+
+// The Rakefile passes the version of the sources being built, so that
+// compilers built from the same sources on different hosts share entries.
+// Without one, every build is a version of its own.
+#ifndef IRON_VERSION
+#define IRON_VERSION __DATE__ " " __TIME__
+#endif
+
+/// @brief Identifies the compiler in cache keys, so that a compiler built
+///   from other sources never reuses what an older one wrote
+static const char* const COMPILER_BUILD = "iron " IRON_VERSION;
+
+/// @brief A 128-bit hash
+struct Digest
+{
+  uint64_t high;
+  uint64_t low;
+
+  /// @return the hash as 32 hex digits
+  std::string hex() const
+  {
+    char text[33];
+    snprintf(text, sizeof(text), "%016llx%016llx",
+      static_cast<unsigned long long>(high), static_cast<unsigned long long>(low));
+    return text;
+  }
+};
+
+/// @brief Hashes @p bytes with MurmurHash3 (x64, 128 bits), which reads
+///   16 bytes per step, so hashing a large source costs far less than lexing it
+inline Digest hash128(PtrRange<const byte_t> bytes, uint64_t seed = 0)
+{
+  static const uint64_t C1 = 0x87c37b91114253d5ull;
+  static const uint64_t C2 = 0x4cf5ad432745937full;
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto fmix = [](uint64_t k)
+  {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+  };
+
+  const size_t size = bytes.size();
+  const byte_t* data = bytes.isEmpty() ? nullptr : &bytes.front();
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+  for (size_t i=0; i<size/16; ++i)
+  {
+    uint64_t k1;
+    uint64_t k2;
+    memcpy(&k1, data + i*16, sizeof(k1));
+    memcpy(&k2, data + i*16 + 8, sizeof(k2));
+
+    k1 *= C1; k1 = rotl(k1, 31); k1 *= C2; h1 ^= k1;
+    h1 = rotl(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+    k2 *= C2; k2 = rotl(k2, 33); k2 *= C1; h2 ^= k2;
+    h2 = rotl(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+  }
+
+  // The last 0 to 15 bytes, little-endian: bytes 8 and up go into k2
+  const byte_t* tail = data + (size & ~size_t(15));
+  const size_t rest = size & 15;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  for (size_t i=rest; i>8; --i) { k2 ^= uint64_t(ubyte_t(tail[i - 1])) << ((i - 9) * 8); }
+  for (size_t i=std::min<size_t>(rest, 8); i>0; --i) { k1 ^= uint64_t(ubyte_t(tail[i - 1])) << ((i - 1) * 8); }
+  if (rest > 8) { k2 *= C2; k2 = rotl(k2, 33); k2 *= C1; h2 ^= k2; }
+  if (rest > 0) { k1 *= C1; k1 = rotl(k1, 31); k1 *= C2; h1 ^= k1; }
+
+  h1 ^= size; h2 ^= size;
+  h1 += h2; h2 += h1;
+  h1 = fmix(h1); h2 = fmix(h2);
+  h1 += h2; h2 += h1;
+  return {h1, h2};
+}
+
+/// @return the key of what is compiled from @p source as @p settings say.
+///   @p settings names the build of the compiler and every option that
+///   changes its output.
+inline std::string cacheKey(PtrRange<const byte_t> source, const std::string& settings)
+{
+  const PtrRange<const byte_t> settingsBytes = settings.empty() ?
+    PtrRange<const byte_t>{} :
+    PtrRange<const byte_t>{reinterpret_cast<const byte_t*>(settings.data()),
+      reinterpret_cast<const byte_t*>(settings.data()) + settings.size() - 1};
+  return hash128(source, hash128(settingsBytes).low).hex();
+}
+
+struct CacheStats
+{
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  size_t entries = 0;
+  uint64_t bytes = 0;
+};
+
+/// @brief Compiler outputs kept on disk by the key of their source and
+///   settings, shared by every iron process that uses the same directory.
+///
+/// An entry is written to a temporary file and renamed into place, so no
+/// process ever sees part of one. Using an entry marks it as recently used;
+/// once the entries take more than the size limit, the least recently used
+/// ones are removed. A process that is reading an entry when it is removed
+/// still reads all of it.
+class Cache
+{
+private :
+  std::string _dir;
+  uint64_t _limit;
+
+  static const size_t KEY_SIZE = 32;
+  /// @brief Temporary files left behind by killed processes are removed
+  ///   once they are this old
+  static const time_t STALE_SECONDS = 60 * 60;
+
+  std::string path(const std::string& name) const { return _dir + "/" + name; }
+
+  static bool isKey(const char* name)
+  {
+    return strlen(name) == KEY_SIZE && strspn(name, "0123456789abcdef") == KEY_SIZE;
+  }
+
+  /// @brief Copies the open file @p from to @p to, with the same mode
+  static bool copy(int from, int to)
+  {
+    struct stat info;
+    if (fstat(from, &info) != 0 || fchmod(to, info.st_mode & 0777) != 0) { return false; }
+
+    char buffer[1 << 16];
+    while (true)
+    {
+      const auto size = read(from, buffer, sizeof(buffer));
+      if (size == 0) { return true; }
+      if (size < 0)
+      {
+        if (errno == EINTR) { continue; }
+        return false;
+      }
+      for (ssize_t written=0; written<size; )
+      {
+        const auto count = write(to, buffer + written, size - written);
+        if (count < 0 && errno != EINTR) { return false; }
+        if (count > 0) { written += count; }
+      }
+    }
+  }
+
+  /// @brief Calls @p visit(name, info) for every entry, and removes stale
+  ///   temporary files along the way
+  template<typename Tfunc>
+  void forEachEntry(Tfunc&& visit) const
+  {
+    DIR* dir = opendir(_dir.c_str());
+    if (dir == nullptr) { return; }
+
+    const time_t now = time(nullptr);
+    while (const dirent* entry = readdir(dir))
+    {
+      struct stat info;
+      const auto file = path(entry->d_name);
+      if (stat(file.c_str(), &info) != 0) { continue; }
+
+      if (isKey(entry->d_name))
+      {
+        visit(file, info);
+      }
+      else if (strncmp(entry->d_name, "tmp.", 4) == 0 && now - info.st_mtime > STALE_SECONDS)
+      {
+        unlink(file.c_str());
+      }
+    }
+    closedir(dir);
+  }
+
+  /// @brief Removes the least recently used entries until the rest fit in
+  ///   the size limit
+  void evict()
+  {
+    struct Entry
+    {
+      std::string file;
+      time_t used;
+      uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    forEachEntry([&](const std::string& file, const struct stat& info)
+    {
+      entries.push_back({file, info.st_mtime, uint64_t(info.st_size)});
+      total += info.st_size;
+    });
+    if (total <= _limit) { return; }
+
+    std::sort(entries.begin(), entries.end(),
+      [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (const auto& entry : entries)
+    {
+      if (total <= _limit) { break; }
+      // Another process may have removed it already
+      unlink(entry.file.c_str());
+      total -= entry.size;
+    }
+  }
+
+  /// @brief Adds @p hits and @p misses to the counts in the stats file,
+  ///   under a lock, and reads the totals back into @p stats
+  bool updateStats(uint64_t hits, uint64_t misses, CacheStats& stats) const
+  {
+    const int fd = ::open(path("stats").c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) { return false; }
+    const bool isReadOnly = (hits == 0 && misses == 0);
+    if (flock(fd, isReadOnly ? LOCK_SH : LOCK_EX) != 0)
+    {
+      ::close(fd);
+      return false;
+    }
+
+    char text[64] = {};
+    unsigned long long oldHits = 0;
+    unsigned long long oldMisses = 0;
+    if (pread(fd, text, sizeof(text) - 1, 0) > 0)
+    {
+      (void) sscanf(text, "%llu %llu", &oldHits, &oldMisses);
+    }
+    stats.hits = oldHits + hits;
+    stats.misses = oldMisses + misses;
+
+    bool written = true;
+    if (!isReadOnly)
+    {
+      const int size = snprintf(text, sizeof(text), "%llu %llu\n",
+        static_cast<unsigned long long>(stats.hits),
+        static_cast<unsigned long long>(stats.misses));
+      written = ftruncate(fd, 0) == 0 && pwrite(fd, text, size, 0) == size;
+    }
+    ::close(fd);
+    return written;
+  }
+
+public :
+  /// @brief The default size limit, in bytes
+  static const uint64_t DEFAULT_LIMIT = uint64_t(1) << 30;
+
+  Cache(std::string dir, uint64_t limit = DEFAULT_LIMIT) :
+      _dir(std::move(dir)), _limit(limit)
+  {}
+
+  /// @brief Creates the directory of the cache if it does not exist
+  /// @return false after reporting an error
+  bool open() const
+  {
+    if (mkdir(_dir.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+      const char* reason = strerror(errno);
+      errorln("Could not create the cache directory '", _dir, "': ", reason);
+      return false;
+    }
+    return true;
+  }
+
+  /// @brief Copies the entry for @p key to @p outfile, if there is one, and
+  ///   counts a hit or a miss
+  /// @return whether @p outfile now holds the entry
+  bool fetch(const std::string& key, const std::string& outfile) const
+  {
+    const auto entry = path(key);
+    const int from = ::open(entry.c_str(), O_RDONLY);
+    bool fetched = false;
+    if (from >= 0)
+    {
+      const int to = ::open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      fetched = to >= 0 && copy(from, to);
+      if (to >= 0) { ::close(to); }
+      ::close(from);
+      // Marks the entry as recently used
+      if (fetched) { (void) utimensat(AT_FDCWD, entry.c_str(), nullptr, 0); }
+    }
+
+    CacheStats stats;
+    (void) updateStats(fetched ? 1 : 0, fetched ? 0 : 1, stats);
+    return fetched;
+  }
+
+  /// @brief Keeps a copy of @p outfile as the entry for @p key. A failure
+  ///   only costs a later miss, so it is not reported.
+  void store(const std::string& key, const std::string& outfile)
+  {
+    auto temp = path("tmp.XXXXXX");
+    const int to = mkstemp(&temp[0]);
+    if (to < 0) { return; }
+
+    const int from = ::open(outfile.c_str(), O_RDONLY);
+    const bool copied = from >= 0 && copy(from, to);
+    if (from >= 0) { ::close(from); }
+    ::close(to);
+
+    // Replaces an entry that another process stored meanwhile, which holds
+    // the same output
+    if (!copied || rename(temp.c_str(), path(key).c_str()) != 0)
+    {
+      unlink(temp.c_str());
+      return;
+    }
+    evict();
+  }
+
+  /// @return false after reporting an error
+  bool stats(CacheStats& stats) const
+  {
+    if (!updateStats(0, 0, stats))
+    {
+      errorln("Could not read the statistics of the cache in '", _dir, '\'');
+      return false;
+    }
+    forEachEntry([&](const std::string&, const struct stat& info)
+    {
+      ++stats.entries;
+      stats.bytes += info.st_size;
+    });
+    return true;
+  }
+};
+
+} // namespace iron
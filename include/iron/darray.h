@@ -1,77 +1,309 @@
 #pragma once
 
+// standard includes
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
 // iron includes
+#include "iron/print.h"
 #include "iron/range.h"
 
 namespace iron
 {
 
-/// @brief dynamic (resizeable) array
+/// @brief Whether a Ttype can be moved to a new address with memcpy, leaving
+///   nothing behind to destroy. Specialize this for types that are
+///   relocatable without being trivially copyable.
+template<typename Ttype>
+struct IsRelocatable :
+  std::integral_constant<bool, std::is_trivially_copyable<Ttype>::value>
+{};
+
+/// A shared_ptr is a pair of pointers that nothing else points back into.
+template<typename Ttype>
+struct IsRelocatable<std::shared_ptr<Ttype>> : std::true_type {};
+
+/// @brief Storage for the elements a Darray holds before it needs the heap
+template<typename Ttype, size_t Tcount>
+struct InlineStorage
+{
+  typename std::aligned_storage<sizeof(Ttype) * Tcount, alignof(Ttype)>::type bytes;
+
+  Ttype* ptr() { return reinterpret_cast<Ttype*>(&bytes); }
+};
+
 template<typename Ttype>
+struct InlineStorage<Ttype, 0>
+{
+  Ttype* ptr() { return nullptr; }
+};
+
+/// @brief dynamic (resizeable) array
+/// @tparam TinlineCount the number of elements stored inside the Darray
+///   itself before the first heap allocation. Use this for arrays that are
+///   usually tiny.
+template<typename Ttype, size_t TinlineCount = 0>
 class Darray
 {
 private :
-  byte_t* _buffer;
-  size_t _bufferSize;
+  Ttype* _begin;
   size_t _count;
+  size_t _capacity;
+  InlineStorage<Ttype, TinlineCount> _inline;
 
 public :
-  Darray() : _buffer(nullptr), _bufferSize(0), _count(0) {}
-  /// @brief copying disabled (for now)
-  Darray(const Darray&) = delete;
+  Darray() : _begin(nullptr), _count(0), _capacity(TinlineCount)
+  {
+    _begin = _inline.ptr();
+  }
+  Darray(const Darray& copyThis) : Darray()
+  {
+    append(copyThis);
+  }
   Darray(Darray&& moveThis) : Darray()
   {
-    swap(moveThis);
+    take(moveThis);
   }
   ~Darray()
   {
-    if (_buffer != nullptr) { free(_buffer); }
+    clear();
+    release();
+  }
+
+  Darray& operator=(const Darray& copyThis)
+  {
+    if (this != &copyThis)
+    {
+      clear();
+      append(copyThis);
+    }
+    return *this;
+  }
+
+  Darray& operator=(Darray&& moveThis)
+  {
+    if (this != &moveThis)
+    {
+      clear();
+      release();
+      take(moveThis);
+    }
+    return *this;
   }
 
   PtrRange<Ttype> all() { return {ptr(), ptr() + _count - 1}; }
   PtrRange<Ttype> all() const { return {ptr(), ptr() + _count - 1}; }
+  Ttype& at(size_t index) { return _begin[index]; }
+  const Ttype& at(size_t index) const { return _begin[index]; }
+  /// @pre the Darray is not empty
+  Ttype& back() { return _begin[_count - 1]; }
+  const Ttype& back() const { return _begin[_count - 1]; }
+  size_t capacity() const { return _capacity; }
   size_t count() const { return _count; }
 
   bool isEmpty() const { return _count == 0; }
 
+  /// @brief Destroys every element. The capacity is kept.
+  void clear()
+  {
+    destroy(_begin, _count);
+    _count = 0;
+  }
+
+  /// @brief Copies every element of @p copyThis onto the end
+  void append(const Darray& copyThis)
+  {
+    // Grow geometrically, so appending many small arrays stays linear
+    if (_count + copyThis._count > _capacity) { grow(_count + copyThis._count); }
+    if (std::is_trivially_copyable<Ttype>::value && copyThis._count > 0)
+    {
+      memcpy(static_cast<void*>(ptr(_count)),
+        static_cast<const void*>(copyThis.ptr()), sizeof(Ttype) * copyThis._count);
+    }
+    else
+    {
+      for (size_t i=0; i<copyThis._count; ++i)
+      {
+        (void) new (ptr(_count + i)) Ttype(copyThis.at(i));
+      }
+    }
+    _count += copyThis._count;
+  }
+
   void pushBack(const Ttype& copyThis)
   {
-    if ((sizeof(Ttype) * (_count + 1)) > _bufferSize) { grow(); }
+    if (_count == _capacity) { grow(_count + 1); }
     (void) new (ptr(_count)) Ttype(copyThis);
     ++_count;
   }
 
   void pushBack(Ttype&& moveThis)
   {
-    if ((sizeof(Ttype) * (_count + 1)) > _bufferSize) { grow(); }
+    if (_count == _capacity) { grow(_count + 1); }
     (void) new (ptr(_count)) Ttype(std::move(moveThis));
     ++_count;
   }
 
+  /// @pre the Darray is not empty
+  void popBack()
+  {
+    --_count;
+    destroy(ptr(_count), 1);
+  }
+
+  /// @brief Destroys the elements past the first @p count. The capacity is
+  ///   kept.
+  void truncate(size_t count)
+  {
+    if (count < _count)
+    {
+      destroy(ptr(count), _count - count);
+      _count = count;
+    }
+  }
+
+  /// @brief Makes room for at least @p capacity elements
+  void reserve(size_t capacity)
+  {
+    if (capacity > _capacity) { relocate(capacity); }
+  }
+
+  /// @brief Releases capacity beyond the current count, moving the elements
+  ///   back into the inline storage if they fit
+  void shrinkToFit()
+  {
+    const auto capacity = (_count > TinlineCount) ? _count : TinlineCount;
+    if (capacity < _capacity) { relocate(capacity); }
+  }
+
   void swap(Darray& swapThis)
   {
-    std::swap(_buffer, swapThis._buffer);
-    std::swap(_bufferSize, swapThis._bufferSize);
-    std::swap(_count, swapThis._count);
+    Darray temp{std::move(swapThis)};
+    swapThis = std::move(*this);
+    *this = std::move(temp);
   }
 
 private :
   Ttype* ptr(size_t index = 0)
   {
-    return reinterpret_cast<Ttype*>(_buffer) + index;
+    return _begin + index;
   }
 
   Ttype* ptr(size_t index = 0) const
   {
-    return reinterpret_cast<Ttype*>(_buffer) + index;
+    return _begin + index;
+  }
+
+  bool isInline() const
+  {
+    return TinlineCount > 0 &&
+      _begin == const_cast<InlineStorage<Ttype, TinlineCount>&>(_inline).ptr();
+  }
+
+  static void destroy(Ttype* elements, size_t count)
+  {
+    if (!std::is_trivially_destructible<Ttype>::value)
+    {
+      for (size_t i=0; i<count; ++i) { elements[i].~Ttype(); }
+    }
   }
 
-  void grow()
+  /// @brief Moves @p count elements to uninitialized memory at @p to, leaving
+  ///   @p from uninitialized
+  static void transfer(Ttype* to, Ttype* from, size_t count)
   {
-    _bufferSize = (_bufferSize > 0) ? (_bufferSize * 2) : sizeof(Ttype);
-    _buffer = reinterpret_cast<byte_t*>(realloc(_buffer, _bufferSize));
+    if (count == 0) { return; }
+    if (IsRelocatable<Ttype>::value)
+    {
+      memcpy(static_cast<void*>(to), static_cast<const void*>(from),
+        sizeof(Ttype) * count);
+    }
+    else
+    {
+      for (size_t i=0; i<count; ++i)
+      {
+        (void) new (to + i) Ttype(std::move(from[i]));
+      }
+      destroy(from, count);
+    }
+  }
+
+  static Ttype* allocate(Ttype* buffer, size_t capacity)
+  {
+    auto result = static_cast<Ttype*>(
+      realloc(static_cast<void*>(buffer), sizeof(Ttype) * capacity));
+    if (result == nullptr)
+    {
+      errorln("Out of memory growing an array to ", capacity, " elements");
+      abort();
+    }
+    return result;
+  }
+
+  /// @brief Frees the heap buffer, if any
+  /// @pre the elements have already been destroyed or moved out
+  void release()
+  {
+    if (!isInline() && _begin != nullptr) { free(_begin); }
+    _begin = _inline.ptr();
+    _capacity = TinlineCount;
+  }
+
+  /// @brief Moves the contents of @p moveThis into this empty Darray
+  void take(Darray& moveThis)
+  {
+    if (moveThis.isInline())
+    {
+      transfer(_begin, moveThis._begin, moveThis._count);
+    }
+    else
+    {
+      _begin = moveThis._begin;
+      _capacity = moveThis._capacity;
+      moveThis._begin = moveThis._inline.ptr();
+      moveThis._capacity = TinlineCount;
+    }
+    _count = moveThis._count;
+    moveThis._count = 0;
+  }
+
+  void grow(size_t minCapacity)
+  {
+    auto capacity = (_capacity > 0) ? (_capacity * 2) : 4;
+    if (capacity < minCapacity) { capacity = minCapacity; }
+    relocate(capacity);
+  }
+
+  /// @pre @p capacity >= @ref count
+  void relocate(size_t capacity)
+  {
+    if (capacity <= TinlineCount)
+    {
+      // Only shrinkToFit gets here, and only from the heap. Without inline
+      // storage the capacity is 0, so there is nothing to move.
+      auto inlinePtr = _inline.ptr();
+      if (TinlineCount > 0) { transfer(inlinePtr, _begin, _count); }
+      free(_begin);
+      _begin = inlinePtr;
+    }
+    else if (IsRelocatable<Ttype>::value && !isInline())
+    {
+      // realloc may be able to grow in place, and copies bytes when it can't
+      _begin = allocate(_begin, capacity);
+    }
+    else
+    {
+      auto buffer = allocate(nullptr, capacity);
+      transfer(buffer, _begin, _count);
+      if (!isInline()) { free(_begin); }
+      _begin = buffer;
+    }
+    _capacity = capacity;
   }
 };
 
 } // namespace iron
-
@@ -0,0 +1,274 @@
+#pragma once
+
+// standard includes
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// system includes
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// iron includes
+#include "iron/print.h"
+
+// third-party includes
+#include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/System/Host.h"
+#include "llvm/System/Threading.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetRegistry.h"
+#include "llvm/Target/TargetSelect.h"
+
+namespace iron
+{
+
+/// @brief What to write out for a module
+enum class Emit : ubyte_t
+{
+  /// @brief textual LLVM IR
+  ll,
+  /// @brief native assembly
+  assembly,
+  /// @brief a native object file
+  object,
+  /// @brief an object file, linked into a program
+  executable
+};
+
+/// @brief Reads the argument of --emit: ll, asm, obj or exe
+/// @return false if @p text names none of them
+inline bool toEmit(const std::string& text, Emit& emit)
+{
+  if (text == "ll") { emit = Emit::ll; }
+  else if (text == "asm") { emit = Emit::assembly; }
+  else if (text == "obj") { emit = Emit::object; }
+  else if (text == "exe") { emit = Emit::executable; }
+  else { return false; }
+  return true;
+}
+
+/// @brief Turns on the locks that guard LLVM's global state, the first time
+///   it is called on any thread. Until then LLVM assumes that only one
+///   thread uses it, and it may only be turned on once.
+inline void enableThreads()
+{
+  static const bool enabled = llvm::llvm_start_multithreaded();
+  (void) enabled;
+}
+
+/// @brief Registers every target and its asm printer with LLVM, the first time
+///   it is called on any thread
+inline void initializeTargets()
+{
+  static const bool initialized = []
+  {
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllAsmPrinters();
+    return true;
+  }();
+  (void) initialized;
+}
+
+/// @return a new target machine for the host, or null after reporting an
+///   error. A target machine is only used by one thread at a time.
+inline llvm::TargetMachine* createHostMachine()
+{
+  initializeTargets();
+
+  const std::string triple = llvm::sys::getHostTriple();
+  std::string error;
+  const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+  if (target == nullptr)
+  {
+    errorln("Cannot generate code for ", triple.c_str(), ": ", error.c_str());
+    return nullptr;
+  }
+  return target->createTargetMachine(triple, "");
+}
+
+/// @brief Where temporary files go unless a caller says otherwise
+static const char* const DEFAULT_TEMP_DIR = "/tmp";
+
+/// @brief Generates native code for @p module in-process and writes it to
+///   @p out, which may be a file or a buffer in memory
+/// @param machine the target machine to generate code with, or null after
+///   failing to create one
+/// @param fileType whether to write assembly or an object file
+/// @param level how hard the code generator works
+/// @return false after reporting an error
+inline bool emitCode(llvm::Module* module, llvm::TargetMachine* machine,
+  llvm::TargetMachine::CodeGenFileType fileType, llvm::raw_ostream& out,
+  llvm::CodeGenOpt::Level level)
+{
+  if (machine == nullptr) { return false; }
+  module->setTargetTriple(llvm::sys::getHostTriple());
+
+  llvm::formatted_raw_ostream formatted{out};
+  llvm::PassManager passes;
+  passes.add(new llvm::TargetData(*machine->getTargetData()));
+  if (machine->addPassesToEmitFile(passes, formatted, fileType, level))
+  {
+    errorln("The host target cannot emit this kind of file.");
+    return false;
+  }
+  passes.run(*module);
+  return true;
+}
+
+/// @brief Writes the object code for @p module to a new, uniquely named
+///   temporary file in @p tempDir
+/// @param objFile set to the name of the file, which the caller unlinks
+/// @return false after reporting an error, leaving no file behind
+inline bool emitObjectFile(llvm::Module* module, llvm::TargetMachine* machine,
+  llvm::CodeGenOpt::Level level, const std::string& tempDir, std::string& objFile)
+{
+  std::string name = tempDir + "/iron_XXXXXX.o";
+  const int fd = mkstemps(&name[0], 2);
+  if (fd < 0)
+  {
+    errorln("Could not create a temporary object file in ", tempDir);
+    return false;
+  }
+
+  bool emitted = false;
+  {
+    // Closes fd when it goes out of scope
+    llvm::raw_fd_ostream os{fd, true};
+    emitted = emitCode(module, machine, llvm::TargetMachine::CGFT_ObjectFile, os, level);
+  }
+  if (!emitted)
+  {
+    unlink(name.c_str());
+    return false;
+  }
+  objFile = name;
+  return true;
+}
+
+/// @brief Runs the program @p args[0], found on the PATH, with the
+///   arguments @p args and waits for it. No shell sees the arguments. What
+///   the program writes goes where errors are reported on this thread.
+/// @return whether it ran and exited with 0
+inline bool spawn(const std::vector<std::string>& args)
+{
+  std::vector<char*> argv;
+  for (const auto& arg : args) { argv.push_back(const_cast<char*>(arg.c_str())); }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (errorFile != nullptr)
+  {
+    fflush(errorFile);
+    posix_spawn_file_actions_adddup2(&actions, fileno(errorFile), STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, fileno(errorFile), STDERR_FILENO);
+  }
+  pid_t pid = 0;
+  const int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0)
+  {
+    errorln("Could not run ", args.front(), ": ", std::string(strerror(error)));
+    return false;
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR) { return false; }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/// @brief Links @p objFiles, in order, into the program or the single
+///   relocatable object file @p outfile
+/// @param emit Emit::executable or Emit::object
+/// @return false after reporting an error
+inline bool link(const std::vector<std::string>& objFiles, Emit emit,
+  const std::string& outfile)
+{
+  std::vector<std::string> args = (emit == Emit::executable) ?
+    std::vector<std::string>{"gcc"} :
+    std::vector<std::string>{"ld", "-r"};
+  args.insert(args.end(), objFiles.begin(), objFiles.end());
+  args.push_back("-o");
+  args.push_back(outfile);
+  if (!spawn(args))
+  {
+    errorln("Error linking ", outfile.c_str());
+    return false;
+  }
+  return true;
+}
+
+/// @brief Writes @p module to @p outfile as @p emit says.
+///
+/// Native code is generated in-process. An executable is linked from an
+/// object file in a uniquely named temporary file, which is the only step
+/// that runs another program.
+/// @param machine the target machine to generate native code with. It is
+///   not used for Emit::ll.
+/// @param level how hard the code generator works
+/// @param tempDir where to put the object file an executable is linked from
+/// @return false after reporting an error
+inline bool emit(llvm::Module* module, Emit emit, const std::string& outfile,
+  llvm::TargetMachine* machine,
+  llvm::CodeGenOpt::Level level = llvm::CodeGenOpt::Default,
+  const std::string& tempDir = DEFAULT_TEMP_DIR)
+{
+  std::string error;
+  switch (emit)
+  {
+    case Emit::ll :
+    {
+      llvm::raw_fd_ostream os{outfile.c_str(), error};
+      if (error.empty()) { module->print(os, nullptr); }
+      break;
+    }
+    case Emit::assembly :
+    {
+      llvm::raw_fd_ostream os{outfile.c_str(), error};
+      if (error.empty() &&
+        !emitCode(module, machine, llvm::TargetMachine::CGFT_AssemblyFile, os, level))
+      {
+        return false;
+      }
+      break;
+    }
+    case Emit::object :
+    {
+      llvm::raw_fd_ostream os{outfile.c_str(), error, llvm::raw_fd_ostream::F_Binary};
+      if (error.empty() &&
+        !emitCode(module, machine, llvm::TargetMachine::CGFT_ObjectFile, os, level))
+      {
+        return false;
+      }
+      break;
+    }
+    case Emit::executable :
+    {
+      std::string objFile;
+      if (!emitObjectFile(module, machine, level, tempDir, objFile)) { return false; }
+      const bool linked = link({objFile}, emit, outfile);
+      unlink(objFile.c_str());
+      return linked;
+    }
+  }
+
+  if (!error.empty())
+  {
+    errorln("Could not write ", outfile.c_str(), ": ", error.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace iron
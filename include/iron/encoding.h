@@ -0,0 +1,109 @@
+#pragma once
+
+// iron includes
+#include "iron/range.h"
+#include "iron/types.h"
+
+namespace iron
+{
+
+/// @brief The character encodings a source buffer can be validated against
+enum class Encoding
+{
+  /// @brief 7-bit ASCII
+  ascii,
+  /// @brief Well-formed UTF-8: no overlong forms, surrogates or code points
+  ///   past U+10FFFF
+  utf8
+};
+
+namespace simd
+{
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+/// @return a bit per byte of @p v, set when that byte is NUL or not ASCII
+inline uint32_t nonAsciiMask(Vec v)
+{
+  return mask(v) | mask(equal(v, '\0'));
+}
+
+#endif
+
+/// @return the number of leading bytes of @p data that are non-NUL ASCII
+inline size_t spanAscii(const byte_t* data, size_t size)
+{
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; i + WIDTH <= size; i += WIDTH)
+  {
+    const auto bad = nonAsciiMask(load(data + i));
+    if (bad != 0)
+    {
+      return i + __builtin_ctz(bad);
+    }
+  }
+#endif
+  while (i < size && data[i] > 0) { ++i; }
+  return i;
+}
+
+/// @return the length of the well-formed UTF-8 sequence at the start of
+///   @p data, or 0 if it is malformed
+/// @pre @p size > 0 and the first byte is not ASCII
+inline size_t utf8SequenceSize(const ubyte_t* data, size_t size)
+{
+  const auto lead = data[0];
+  size_t length = 0;
+  // The valid range of the second byte, which rules out overlong forms,
+  // surrogates and code points past U+10FFFF
+  ubyte_t lo = 0x80;
+  ubyte_t hi = 0xbf;
+  if (lead >= 0xc2 && lead <= 0xdf) { length = 2; }
+  else if (lead == 0xe0) { length = 3; lo = 0xa0; }
+  else if (lead == 0xed) { length = 3; hi = 0x9f; }
+  else if (lead >= 0xe1 && lead <= 0xef) { length = 3; }
+  else if (lead == 0xf0) { length = 4; lo = 0x90; }
+  else if (lead >= 0xf1 && lead <= 0xf3) { length = 4; }
+  else if (lead == 0xf4) { length = 4; hi = 0x8f; }
+  else { return 0; }
+
+  if (length > size) { return 0; }
+  if (data[1] < lo || data[1] > hi) { return 0; }
+  for (size_t i=2; i<length; ++i)
+  {
+    if (data[i] < 0x80 || data[i] > 0xbf) { return 0; }
+  }
+  return length;
+}
+
+} // namespace simd
+
+/// @return the offset of the first byte of @p bytes that is not valid in
+///   @p encoding, or the size of @p bytes if it is all valid. NUL bytes are
+///   never valid. For UTF-8 the offset is that of the lead byte of the first
+///   malformed sequence.
+inline size_t findInvalid(PtrRange<const byte_t> bytes, Encoding encoding)
+{
+  if (bytes.isEmpty()) { return 0; }
+
+  const auto size = bytes.size();
+  const byte_t* data = &bytes.front();
+  size_t i = simd::spanAscii(data, size);
+  if (encoding == Encoding::ascii) { return i; }
+
+  // Source is overwhelmingly ASCII, so only drop out of the vector scan for
+  // the multi-byte sequences themselves.
+  while (i < size)
+  {
+    if (data[i] == '\0') { return i; }
+    const auto length = simd::utf8SequenceSize(
+      reinterpret_cast<const ubyte_t*>(data + i), size - i);
+    if (length == 0) { return i; }
+    i += length;
+    i += simd::spanAscii(data + i, size - i);
+  }
+  return size;
+}
+
+} // namespace iron
@@ -1,9 +1,20 @@
 #pragma once
 
 /// standard includes
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 
+/// system includes
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 /// iron includes
+#include "iron/encoding.h"
+#include "iron/print.h"
 #include "iron/range.h"
 #include "iron/types.h"
 
@@ -11,36 +22,64 @@ namespace iron
 {
 using String = std::string;
 
+/// @brief A read-only view of an Iron source file.
+///
+/// Regular files are memory-mapped so @ref all refers directly to the page
+/// cache; nothing is copied and pages are faulted in as the lexer reaches
+/// them. Pipes, character devices and stdin (the path "-") cannot be mapped,
+/// so those are read into a heap buffer instead.
 class File
 {
 private:
   const byte_t* _buffer;
-  FILE* _handle;
+  int _handle;
   const String _path;
-  const size_t _size;
+  size_t _size;
+  /// @brief true when @ref _buffer must be munmap'd instead of free'd
+  bool _isMapped;
 
 public:
   File() = delete;
   File(const File&) = delete;
-  File(File&& moveThis) : _path(moveThis._path), _size(moveThis._size)
+  File(File&& moveThis) :
+      _buffer(moveThis._buffer), _handle(moveThis._handle),
+      _path(moveThis._path), _size(moveThis._size),
+      _isMapped(moveThis._isMapped)
   {
-    _handle = moveThis._handle;
-    moveThis._handle = nullptr;
-    _buffer = moveThis._buffer;
     moveThis._buffer = nullptr;
+    moveThis._handle = -1;
+    moveThis._size = 0;
+    moveThis._isMapped = false;
   }
-  File(String path) : _handle(fopen(path.c_str(), "r")), _path(path), _size(initSize())
+  /// @param mayMap false to read the file into memory even if it could be
+  ///   mapped. A mapped file changes when it is written to, and a read one
+  ///   keeps what it held when it was opened.
+  File(String path, bool mayMap = true) :
+      _buffer(nullptr), _handle(openHandle(path)), _path(path), _size(0),
+      _isMapped(false)
   {
-    _buffer = reinterpret_cast<const byte_t*>(malloc(_size));;
-    // TODO: Handle cstdio error codes
-    fread(const_cast<byte_t*>(_buffer), sizeof(byte_t), _size, _handle);
+    if (!isOpen())
+    {
+      const char* reason = strerror(errno);
+      errorln("Could not open '", _path, "': ", reason);
+      return;
+    }
+
+    if (!mayMap || !map()) { read(); }
   }
   ~File()
   {
     close();
     if (_buffer != nullptr)
     {
-      free(const_cast<byte_t*>(_buffer));
+      if (_isMapped)
+      {
+        munmap(const_cast<byte_t*>(_buffer), _size);
+      }
+      else
+      {
+        free(const_cast<byte_t*>(_buffer));
+      }
       _buffer = nullptr;
     }
   }
@@ -54,38 +93,106 @@ public:
 
   void close()
   {
-    if (isOpen()) { fclose(_handle); _handle = nullptr; }
+    if (isOpen())
+    {
+      // The stdin descriptor belongs to the process, not to this File
+      if (_handle != STDIN_FILENO) { ::close(_handle); }
+      _handle = -1;
+    }
   }
   bool isEmpty() const { return _size == 0; }
-  bool isOpen() const { return _handle != nullptr; }
-  bool isValid() const
+  bool isMapped() const { return _isMapped; }
+  bool isOpen() const { return _handle >= 0; }
+  /// @return the offset of the first byte that is not valid in @p encoding,
+  ///   or @ref size if the whole file is valid
+  size_t firstInvalid(Encoding encoding = Encoding::ascii) const
+  {
+    return findInvalid(all(), encoding);
+  }
+  bool isValid(Encoding encoding = Encoding::ascii) const
+  {
+    return firstInvalid(encoding) == _size;
+  }
+
+  String path() const { return _path; }
+  size_t size() const { return _size; }
+
+private:
+  static int openHandle(const String& path)
+  {
+    if (path == "-") { return STDIN_FILENO; }
+    return open(path.c_str(), O_RDONLY);
+  }
+
+  /// Only call this in a constructor.
+  /// @pre @p this is open (@ref isOpen).
+  /// @return false if the file cannot be mapped and must be read instead
+  bool map()
   {
-    for (size_t i=0; i<_size; ++i)
+    struct stat info;
+    if (fstat(_handle, &info) != 0 || !S_ISREG(info.st_mode))
     {
-      // For now, only handle ASCII
-      if (_buffer[i] <= 0) { return false; }
+      return false;
     }
 
+    // mmap rejects zero-length mappings. An empty file is still a success.
+    if (info.st_size == 0) { return true; }
+
+    const auto size = static_cast<size_t>(info.st_size);
+    auto addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, _handle, 0);
+    if (addr == MAP_FAILED) { return false; }
+
+    // The lexer makes one front-to-back pass, so ask for aggressive
+    // read-ahead and early reclaim of pages behind it.
+    (void) madvise(addr, size, MADV_SEQUENTIAL);
+
+    _buffer = reinterpret_cast<const byte_t*>(addr);
+    _size = size;
+    _isMapped = true;
     return true;
   }
 
-  String path() const { return _path; }
-  bool size() const { return _size; }
-
-private:
-  /// Only call this in a constructor. It will trash the seek pointer for _handle.
+  /// Only call this in a constructor. Reads until EOF, so it also works for
+  /// streams that have no size up front.
   /// @pre @p this is open (@ref isOpen).
-  size_t initSize()
+  void read()
   {
-// TODO: Report cstdio error codes
-    fseek (_handle, 0, SEEK_END);
-// TODO: Report cstdio error codes
-    const auto size = ftell(_handle);
-// TODO: Report cstdio error codes
-    fseek (_handle, 0, SEEK_SET);
-    return static_cast<size_t>(size);
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    byte_t* buffer = nullptr;
+    size_t capacity = 0;
+    size_t size = 0;
+    while (true)
+    {
+      if (size == capacity)
+      {
+        capacity = (capacity > 0) ? (capacity * 2) : CHUNK_SIZE;
+        auto grown = reinterpret_cast<byte_t*>(realloc(buffer, capacity));
+        if (grown == nullptr)
+        {
+          errorln("Out of memory reading '", _path, "' (", capacity, " bytes)");
+          free(buffer);
+          return;
+        }
+        buffer = grown;
+      }
+
+      const auto count = ::read(_handle, buffer + size, capacity - size);
+      if (count == 0) { break; }
+      if (count < 0)
+      {
+        if (errno == EINTR) { continue; }
+        const char* reason = strerror(errno);
+        errorln("Could not read '", _path, "': ", reason);
+        free(buffer);
+        return;
+      }
+      size += static_cast<size_t>(count);
+    }
+
+    _buffer = buffer;
+    _size = size;
   }
 };
 
 } // namespace iron
-
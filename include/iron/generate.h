@@ -1,19 +1,30 @@
 #pragma once
 
 // standard includes
-#include <memory>
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 // iron includes
 #include "iron/ast.h"
+#include "iron/emit.h"
+#include "iron/optimize.h"
+#include "iron/parse.h"
+#include "iron/resolve.h"
+#include "iron/workers.h"
 
 // third-party includes
 #include "llvm/DerivedTypes.h"
 #include "llvm/Function.h"
 #include "llvm/GlobalValue.h"
+#include "llvm/Instructions.h"
 #include "llvm/LLVMContext.h"
 #include "llvm/Module.h"
 #include "llvm/Type.h"
+#include "llvm/ValueSymbolTable.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/Support/IRBuilder.h"
 #include "llvm/Support/raw_ostream.h"
@@ -29,58 +40,101 @@ using FunctionType = llvm::FunctionType;
 using Module = llvm::Module;
 using String = std::string;
 using Type = llvm::Type;
-template<typename Ttype>
-using Shared = std::shared_ptr<Ttype>;
 using Value = llvm::Value;
 
-bool generate(Shared<ast::Node> node, Builder& builder, Module* module, Value*& value);
-bool generate(Shared<ast::Node> node, Builder& builder, Module* module);
+/// @brief Views the interned text of @p symbol without copying it
+inline llvm::StringRef toStringRef(Symbol symbol)
+{
+  const auto text = symbol.text();
+  return text.isEmpty() ? llvm::StringRef{} : llvm::StringRef{&text.at(0), text.size()};
+}
 
-bool generate(Shared<ast::Block> block, Function* fn, Builder& builder, Module* module)
+/// @brief A module being generated, with the LLVM values that declarations
+///   in the tree have in it. @ref ast::resolve binds every name to its
+///   declaration, so finding the value of a name never compares strings.
+struct Unit
 {
-  (void) fn;
+  Module* module;
+  /// @brief The function of each function definition declared in
+  ///   @ref module, by the index of the definition
+  std::unordered_map<uint32_t, Function*> functions;
+  /// @brief The stack slot of each local variable generated so far, by the
+  ///   index of its declaration
+  std::unordered_map<uint32_t, llvm::AllocaInst*> locals;
+
+  explicit Unit(Module* module) : module(module) {}
+};
+
+bool generate(const ast::Tree& tree, ast::Ref node, Builder& builder, Unit& unit,
+    Value*& value);
+
+/// @return whether @p fn is the program's entry point
+inline bool isMain(const Function* fn)
+{
+  return fn->getName() == "main";
+}
 
-  Value* value = nullptr;
-  if (block->isEmpty())
+/// @brief Returns from the function being generated without a value. main
+///   always returns an exit code, so there it returns 0.
+/// @return false if the function has outputs, so needs a value to return
+inline bool generateRetVoid(Builder& builder, Value*& value)
+{
+  auto fn = builder.GetInsertBlock()->getParent();
+  if (fn->getReturnType()->isVoidTy())
   {
-    // Finish off the function.
     value = builder.CreateRetVoid();
   }
+  else if (isMain(fn))
+  {
+    value = builder.CreateRet(llvm::ConstantInt::get(fn->getReturnType(), 0));
+  }
   else
   {
-    for (auto stmnts = block->stmnts(); !stmnts.isEmpty(); stmnts.pop())
-    {
-      if (!generate(stmnts.front(), builder, module, value)) { return false; }
-    }
+    return false;
   }
-
   return value != nullptr;
 }
 
-bool generate(Shared<ast::FuncDefn> funcDefn, Module* module)
+inline bool generate(const ast::Tree& tree, const ast::Block& block, Function* fn,
+    Builder& builder, Unit& unit)
 {
-  auto& context = llvm::getGlobalContext();
+  (void) fn;
+
+  for (auto stmnts = tree.list(block.stmnts); !stmnts.isEmpty(); stmnts.pop())
+  {
+    Value* value = nullptr;
+    if (!generate(tree, stmnts.front(), builder, unit, value)) { return false; }
+  }
+  return true;
+}
+
+/// @brief Adds the function @p funcDefn defines to @p module, without a body
+/// @return the function, or null after reporting an error
+inline Function* declare(const ast::Tree& tree, const ast::FuncDefn& funcDefn,
+    Module* module)
+{
+  auto& context = module->getContext();
+  static const auto MAIN = symbols().intern("main"_ascii);
   const llvm::Type* llvmRetType = nullptr;
-  if (funcDefn->funcType->outs.isEmpty())
+  if (tree.get<ast::FuncType>(funcDefn.funcType).outs.count == 0 && funcDefn.name != MAIN)
   {
     llvmRetType = Type::getVoidTy(context);
   }
   else
   {
+    // main returns the exit code of the program, whether or not it says so
     // TODO: This needs to be more sophisticated
     llvmRetType = llvm::IntegerType::get(context, 32);
   }
   static const bool IS_VARARG = false;
   auto llvmFuncType = FunctionType::get(llvmRetType, IS_VARARG);
-  std::string name { &funcDefn->name.front(), funcDefn->name.size() };
   // TODO: Instead of doing this, should an attribute be applied to the function
   //   name? Perhaps nomangle or extern?
   // TODO: Alternately, should main be defined by the compiler and then provide
   //   intelligent resolution to the user-defined main?
-  if (name != "main")
-  {
-    name = funcDefn->mangledName();
-  }
+  const String name = (funcDefn.name == MAIN) ?
+    funcDefn.name.str() :
+    funcDefn.mangledName();
   auto llvmFunc = Function::Create(llvmFuncType, Global::ExternalLinkage, name, module);
 
   // LLVM will rename the function if that name is already taken. This is not desireable.
@@ -88,147 +142,284 @@ bool generate(Shared<ast::FuncDefn> funcDefn, Module* module)
   if (llvmFunc->getName() != name)
   {
     errorln("Redefinition of ", name.c_str());
-    return false;
+    return nullptr;
   }
 
   // TODO: Add names for all the arguments
 
-  auto bb = BasicBlock::Create(llvm::getGlobalContext(), name + "__body", llvmFunc);
+  return llvmFunc;
+}
+
+/// @brief Declares the function @p funcDefn defines in @p unit, unless it is
+///   already declared there
+/// @return the function, or null after reporting an error
+inline Function* declare(const ast::Tree& tree, ast::Ref funcDefn, Unit& unit)
+{
+  auto& llvmFunc = unit.functions[funcDefn.index()];
+  if (llvmFunc == nullptr)
+  {
+    llvmFunc = declare(tree, tree.get<ast::FuncDefn>(funcDefn), unit.module);
+  }
+  return llvmFunc;
+}
+
+/// @brief Generates the body of @p funcDefn into @p llvmFunc, which
+///   @ref declare returned for it
+inline bool define(const ast::Tree& tree, const ast::FuncDefn& funcDefn,
+    Function* llvmFunc, Unit& unit)
+{
+  const String name = llvmFunc->getName().str();
+  auto bb = BasicBlock::Create(unit.module->getContext(), name + "__body", llvmFunc);
   Builder blockBuilder { bb };
 
-  if (!generate(funcDefn->block, llvmFunc, blockBuilder, module))
+  const auto& block = tree.get<ast::Block>(funcDefn.block);
+  if (!generate(tree, block, llvmFunc, blockBuilder, unit))
   {
     errorln("Failed to generate the block for ", name);
     return false;
   }
 
+  // Falling off the end of a function returns from it
+  Value* ret = nullptr;
+  if (blockBuilder.GetInsertBlock()->getTerminator() == nullptr &&
+    !generateRetVoid(blockBuilder, ret))
+  {
+    errorln("At ", tree.pos(funcDefn.block), " -- ", name,
+      " needs to return a value at its end");
+    return false;
+  }
+
   // Validate the generated code, checking for consistency.
   llvm::verifyFunction(*llvmFunc);
 
   return true;
 }
 
-bool generate(Shared<ast::Namespace> nspace, Builder& builder, Module* module)
+/// @brief Adds the function definitions of @p nspace and of the namespaces
+///   within it to @p funcDefns, in source order
+inline void collectFuncDefns(const ast::Tree& tree, ast::Ref nspace,
+    Darray<ast::Ref>& funcDefns)
 {
-  for (auto decls = nspace->decls.all(); !decls.isEmpty(); decls.pop())
+  const auto& decls = tree.get<ast::Namespace>(nspace).decls;
+  for (auto list = tree.list(decls); !list.isEmpty(); list.pop())
   {
-    auto& decl = decls.front();
-    if (!generate(decl, builder, module))
+    const auto decl = list.front();
+    if (decl.kind() == ast::Kind::func_defn) { funcDefns.pushBack(decl); }
+    else if (decl.kind() == ast::Kind::nspace) { collectFuncDefns(tree, decl, funcDefns); }
+  }
+}
+
+/// @brief Generates every function definition in @p tree. Every function is
+///   declared before any is defined, so a function can call one that is
+///   defined after it.
+/// @pre @p tree is resolved
+inline bool generate(const ast::Tree& tree, Unit& unit)
+{
+  Darray<ast::Ref> funcDefns;
+  collectFuncDefns(tree, tree.root(), funcDefns);
+  for (size_t i=0; i<funcDefns.count(); ++i)
+  {
+    if (declare(tree, funcDefns.at(i), unit) == nullptr) { return false; }
+  }
+
+  for (size_t i=0; i<funcDefns.count(); ++i)
+  {
+    const auto funcDefn = funcDefns.at(i);
+    IRON_TRACE(codegen, "func_defn", tree.pos(funcDefn).row, tree.pos(funcDefn).col);
+    if (!define(tree, tree.get<ast::FuncDefn>(funcDefn),
+      unit.functions.at(funcDefn.index()), unit))
     {
-errorln("Failed to generate a declaration within namespace ", nspace->name.c_str());
       return false;
     }
   }
-  
   return true;
 }
 
-bool generate(Shared<ast::Node> node, Builder& builder, Module* module)
+/// @brief Applies @p binaryExpr to operands that are already generated
+inline bool generate(const ast::BinExpr& binaryExpr, Value* lhsValue, Value* rhsValue,
+    Builder& builder, Value*& value)
 {
-  bool result = false;
-
-  switch (node->kind())
+  // Perform the binary operation
+  switch (binaryExpr.type)
   {
-    case ast::Node::Kind::func_defn :
+    case Token::Type::fwd_slash : // division
+    {
+      // TODO: Need to figure out when to use exact or not.
+      // TODO: Need to call SDiv or UDiv depending on parameters
+      // TODO: Will need to be a function call when applicable
+      value = builder.CreateExactSDiv(lhsValue, rhsValue);
+      break;
+    }
+    case Token::Type::plus :
     {
-      auto funcDefn = std::static_pointer_cast<ast::FuncDefn>(node);
-      result = generate(funcDefn, module);
+      value = builder.CreateAdd(lhsValue, rhsValue);
       break;
     }
-    case ast::Node::Kind::nspace :
+    case Token::Type::minus :
     {
-      auto nspace = std::static_pointer_cast<ast::Namespace>(node);
-      result = generate(nspace, builder, module);
+      value = builder.CreateSub(lhsValue, rhsValue);
+      break;
+    }
+    case Token::Type::asterisk :
+    {
+      value = builder.CreateMul(lhsValue, rhsValue);
       break;
     }
     default :
     {
-      // Unhandled node type
+fprintf(stderr, "Generation for binary operator %lu is not implemented yet.\n",
+  (size_t) binaryExpr.type);
       assert(false);
-      break;
     }
   }
-
-  return result;
+  return value != nullptr;
 }
 
-bool generate(Shared<ast::BinExpr> binaryExpr, Builder& builder, Module* module,
-    Value*& value)
+/// @brief Generates a whole tree of binary expressions, operands first.
+///
+/// Generated code can nest expressions arbitrarily deep, so this walks the
+/// tree with explicit stacks instead of recursing once per operator.
+inline bool generate(const ast::Tree& tree, const ast::BinExpr& binaryExpr,
+    Builder& builder, Unit& unit, Value*& value)
 {
-  (void) binaryExpr; (void) builder; (void) module; (void) value;
-  // Evaluate the lhs
-  llvm::Value* lhsValue = nullptr;
-  if (!generate(binaryExpr->lhs, builder, module, lhsValue)) { return false; }
+  /// @brief Either an operand to evaluate or an operator to apply
+  struct Step
+  {
+    ast::Ref operand;
+    const ast::BinExpr* op;
+  };
+
+  Darray<Step, 16> steps;
+  Darray<Value*, 16> values;
+  steps.pushBack({{}, &binaryExpr});
+  steps.pushBack({binaryExpr.rhs, nullptr});
+  steps.pushBack({binaryExpr.lhs, nullptr});
+  while (!steps.isEmpty())
+  {
+    const auto step = steps.back();
+    steps.popBack();
 
-  // Evaluate the rhs
-  llvm::Value* rhsValue = nullptr;
-  if (!generate(binaryExpr->rhs, builder, module, rhsValue)) { return false; }
+    if (step.op != nullptr)
+    {
+      auto rhsValue = values.back();
+      values.popBack();
+      auto lhsValue = values.back();
+      values.popBack();
+
+      Value* result = nullptr;
+      if (!generate(*step.op, lhsValue, rhsValue, builder, result)) { return false; }
+      values.pushBack(result);
+    }
+    else if (step.operand.kind() == ast::Kind::binary_expr)
+    {
+      // Evaluate the lhs, then the rhs, then apply the operator
+      const auto& operand = tree.get<ast::BinExpr>(step.operand);
+      steps.pushBack({{}, &operand});
+      steps.pushBack({operand.rhs, nullptr});
+      steps.pushBack({operand.lhs, nullptr});
+    }
+    else
+    {
+      Value* result = nullptr;
+      if (!generate(tree, step.operand, builder, unit, result)) { return false; }
+      values.pushBack(result);
+    }
+  }
 
-  // Perform the binary operation
-  switch (binaryExpr->type)
+  value = values.back();
+  return value != nullptr;
+}
+
+/// @brief Finds the function or reads the local variable that @p decl
+///   declares
+/// @param decl what @p name is bound to
+inline bool generate(ast::Ref decl, Symbol name, Pos pos, Builder& builder, Unit& unit,
+    Value*& value)
+{
+  switch (decl.kind())
   {
-    case Token::Type::fwd_slash : // division
+    case ast::Kind::func_defn :
     {
-      // TODO: Need to figure out when to use exact or not.
-      // TODO: Need to call SDiv or UDiv depending on parameters
-      // TODO: Will need to be a function call when applicable
-      value = builder.CreateExactSDiv(lhsValue, rhsValue);
+      const auto llvmFunc = unit.functions.find(decl.index());
+      if (llvmFunc != unit.functions.end()) { value = llvmFunc->second; }
+      break;
+    }
+    case ast::Kind::var_decl :
+    {
+      const auto slot = unit.locals.find(decl.index());
+      if (slot != unit.locals.end()) { value = builder.CreateLoad(slot->second); }
       break;
     }
     default :
     {
-fprintf(stderr, "Generation for binary operator %lu is not implemented yet.\n",
-  (size_t) binaryExpr->type);
-      assert(false);
+      break;
     }
   }
-  return value != nullptr;
+
+  if (value == nullptr)
+  {
+    errorln("At ", pos, " -- Internal Compiler Error: ", name,
+      " is not resolved to anything generated");
+    return false;
+  }
+  return true;
 }
 
-bool generate(Shared<ast::FuncCall> funcCall, Builder& builder, Module* module,
-    Value*& value)
+inline bool generate(const ast::FuncCall& funcCall, Pos pos, Builder& builder,
+    Unit& unit, Value*& value)
 {
-  (void) funcCall; (void) value; (void) builder;
-  String name { &funcCall->name.front(), funcCall->name.size() };
   // TODO: Need to find a mangled name that matches the name and type of the
   //   function call.
-  auto func = module->getFunction(name);
-  if (func == nullptr)
+  Value* func = nullptr;
+  if (!generate(funcCall.decl, funcCall.name, pos, builder, unit, func)) { return false; }
+
+  // A local variable may hold a pointer to the function to call
+  auto pointerType = llvm::dyn_cast<llvm::PointerType>(func->getType());
+  if (pointerType == nullptr || !llvm::isa<FunctionType>(pointerType->getElementType()))
   {
-    errorln("At ", funcCall->pos(), " -- Could not find a function named ",
-      name.c_str());
+    errorln("At ", pos, " -- ", funcCall.name, " is not a function");
     return false;
   }
   value = builder.CreateCall(func);
   return value != nullptr;
 }
 
-bool generate(Shared<ast::IntLit> intLit, Value*& value)
+inline bool generate(const ast::IntLit& intLit, Unit& unit, Value*& value)
 {
-  auto& context = llvm::getGlobalContext();
+  auto& context = unit.module->getContext();
   // TODO: Adjust the integer literal type based on the number of bits needed
   //   to represent the literal.
   auto intType = llvm::IntegerType::get(context, 32);
-  // TODO: Need an out-of-the box way to convert strings to uint64_ts
-  const char* begin = &intLit->intPart.front();
-  char* end = const_cast<char*>(begin);
-  // TODO: This only works for base 10 numbers
-  uint64_t intValue = strtoull(begin, &end, 10);
-  value = llvm::ConstantInt::get(intType, intValue, !intLit->isNeg);
+  // The literal keeps its magnitude; negating it in two's complement leaves
+  // the bits that a signed constant of any width is built from.
+  const uint64_t bits = intLit.isNeg ? uint64_t(0) - intLit.value : intLit.value;
+  static const bool IS_SIGNED = true;
+  value = llvm::ConstantInt::get(intType, bits, IS_SIGNED);
   return value != nullptr;
 }
 
-bool generate(Shared<ast::RetStmnt> retStmnt, Builder& builder, Module* module,
-    Value*& value)
+inline bool generate(const ast::Tree& tree, const ast::RetStmnt& retStmnt, Pos pos,
+    Builder& builder, Unit& unit, Value*& value)
 {
-  if (retStmnt->isVoid())
+  const auto fn = builder.GetInsertBlock()->getParent();
+  if (retStmnt.isVoid())
   {
-    value = builder.CreateRetVoid();
+    if (!generateRetVoid(builder, value))
+    {
+      errorln("At ", pos, " -- ", fn->getName().str(), " needs a value to return");
+      return false;
+    }
+  }
+  else if (fn->getReturnType()->isVoidTy())
+  {
+    errorln("At ", pos, " -- ", fn->getName().str(),
+      " has no outputs, so it cannot return a value");
+    return false;
   }
   else
   {
     Value* exprValue = nullptr;
-    if (!generate(retStmnt->expr, builder, module, exprValue))
+    if (!generate(tree, retStmnt.expr, builder, unit, exprValue))
     {
       return false;
     }
@@ -237,58 +428,94 @@ bool generate(Shared<ast::RetStmnt> retStmnt, Builder& builder, Module* module,
   return value != nullptr;
 }
 
-bool generate(Shared<ast::VarDeclStmnt> varDeclStmnt, Builder& builder, Module* module,
-    Value*& value)
+/// @brief Gives the local variable a stack slot, which mem2reg promotes to a
+///   register when optimizing, and stores its initial value there
+inline bool generate(const ast::Tree& tree, const ast::VarDeclStmnt& varDeclStmnt,
+    Pos pos, Builder& builder, Unit& unit, Value*& value)
 {
-  (void) builder;
-  String name { &varDeclStmnt->decl->name.front(), varDeclStmnt->decl->name.size() };
-  // TODO: This code is function pointer specific
-  auto arg = varDeclStmnt->initializer->exprs().front();
-  auto lvalue = std::static_pointer_cast<ast::Lvalue>(arg);
-  String fnName { &lvalue->name.front(), lvalue->name.size() };
-  value = module->getFunction(fnName);
+  const auto& varDecl = tree.get<ast::VarDecl>(varDeclStmnt.decl);
+  // TODO: Default construction, and initializers for compound types
+  if (varDeclStmnt.initializer.isNull())
+  {
+    errorln("At ", tree.pos(varDeclStmnt.decl), " -- ", varDecl.name,
+      " needs a value to initialize it with");
+    return false;
+  }
+  const auto& initializer = tree.get<ast::Initializer>(varDeclStmnt.initializer);
+  auto exprs = tree.list(initializer.exprs);
+  if (exprs.size() != 1)
+  {
+    errorln("At ", pos, " -- ", varDecl.name,
+      " needs exactly one value to initialize it with");
+    return false;
+  }
+  // TODO: Check the initial value against the declared type
+  Value* initValue = nullptr;
+  if (!generate(tree, exprs.front(), builder, unit, initValue)) { return false; }
+
+  // The name only makes the IR easier to read; uses find the slot by the
+  // declaration they are bound to
+  static const auto NO_ARRAY_SIZE = nullptr;
+  auto slot = builder.CreateAlloca(initValue->getType(), NO_ARRAY_SIZE,
+    toStringRef(varDecl.name));
+  unit.locals[varDeclStmnt.decl.index()] = slot;
+  value = builder.CreateStore(initValue, slot);
   return value != nullptr;
 }
 
-bool generate(Shared<ast::Node> node, Builder& builder, Module* module, Value*& value)
+inline bool generate(const ast::Tree& tree, ast::Ref node, Builder& builder, Unit& unit,
+    Value*& value)
 {
   bool result = false;
 
-  switch (node->kind())
+  switch (node.kind())
   {
-    case ast::Node::Kind::binary_expr :
+    case ast::Kind::binary_expr :
+    {
+      const auto& binaryExpr = tree.get<ast::BinExpr>(node);
+      result = generate(tree, binaryExpr, builder, unit, value);
+      break;
+    }
+    case ast::Kind::expr_stmnt :
+    {
+      // The value of the expression is unused
+      const auto& exprStmnt = tree.get<ast::ExprStmnt>(node);
+      result = generate(tree, exprStmnt.expr, builder, unit, value);
+      break;
+    }
+    case ast::Kind::func_call :
     {
-      auto binaryExpr = std::static_pointer_cast<ast::BinExpr>(node);
-      result = generate(binaryExpr, builder, module, value);
+      const auto& funcCall = tree.get<ast::FuncCall>(node);
+      result = generate(funcCall, tree.pos(node), builder, unit, value);
       break;
     }
-    case ast::Node::Kind::func_call :
+    case ast::Kind::int_lit :
     {
-      auto funcCall = std::static_pointer_cast<ast::FuncCall>(node);
-      result = generate(funcCall, builder, module, value);
+      const auto& intLit = tree.get<ast::IntLit>(node);
+      result = generate(intLit, unit, value);
       break;
     }
-    case ast::Node::Kind::int_lit :
+    case ast::Kind::lvalue :
     {
-      auto intLit = std::static_pointer_cast<ast::IntLit>(node);
-      result = generate(intLit, value);
+      const auto& lvalue = tree.get<ast::Lvalue>(node);
+      result = generate(lvalue.decl, lvalue.name, tree.pos(node), builder, unit, value);
       break;
     }
-    case ast::Node::Kind::ret_stmnt :
+    case ast::Kind::ret_stmnt :
     {
-      auto retStmnt = std::static_pointer_cast<ast::RetStmnt>(node);
-      result = generate(retStmnt, builder, module, value);
+      const auto& retStmnt = tree.get<ast::RetStmnt>(node);
+      result = generate(tree, retStmnt, tree.pos(node), builder, unit, value);
       break;
     }
-    case ast::Node::Kind::var_decl_stmnt :
+    case ast::Kind::var_decl_stmnt :
     {
-      auto varDecl = std::static_pointer_cast<ast::VarDeclStmnt>(node);
-      result = generate(varDecl, builder, module, value);
+      const auto& varDecl = tree.get<ast::VarDeclStmnt>(node);
+      result = generate(tree, varDecl, tree.pos(node), builder, unit, value);
       break;
     }
     default :
     {
-fprintf(stdout, "kind = %lu\n", (size_t) node->kind());
+fprintf(stdout, "kind = %lu\n", (size_t) node.kind());
       // Unhandled node type
       assert(false);
       break;
@@ -298,57 +525,396 @@ fprintf(stdout, "kind = %lu\n", (size_t) node->kind());
   return result;
 }
 
-void generate(Shared<ast::Node> parseTree, String outfile)
+/// @brief Calls @p visit with the declaration that every function call and
+///   every lvalue in @p block is bound to, however deeply they are nested in
+///   expressions
+template<typename Tfunc>
+void forEachBinding(const ast::Tree& tree, ast::Ref block, Tfunc&& visit)
 {
-  if (outfile.empty())
+  Darray<ast::Ref, 16> nodes;
+  nodes.pushBack(block);
+  auto pushAll = [&](ast::List list)
   {
-    errorln("Cannot compile into a nameless output file.");
-    assert(false);
+    for (auto refs = tree.list(list); !refs.isEmpty(); refs.pop()) { nodes.pushBack(refs.front()); }
+  };
+
+  while (!nodes.isEmpty())
+  {
+    const auto node = nodes.back();
+    nodes.popBack();
+    switch (node.kind())
+    {
+      case ast::Kind::binary_expr :
+      {
+        const auto& binaryExpr = tree.get<ast::BinExpr>(node);
+        nodes.pushBack(binaryExpr.lhs);
+        nodes.pushBack(binaryExpr.rhs);
+        break;
+      }
+      case ast::Kind::block :
+      {
+        pushAll(tree.get<ast::Block>(node).stmnts);
+        break;
+      }
+      case ast::Kind::expr_stmnt :
+      {
+        nodes.pushBack(tree.get<ast::ExprStmnt>(node).expr);
+        break;
+      }
+      case ast::Kind::func_call :
+      {
+        visit(tree.get<ast::FuncCall>(node).decl);
+        break;
+      }
+      case ast::Kind::initializer :
+      {
+        pushAll(tree.get<ast::Initializer>(node).exprs);
+        break;
+      }
+      case ast::Kind::lvalue :
+      {
+        visit(tree.get<ast::Lvalue>(node).decl);
+        break;
+      }
+      case ast::Kind::ret_stmnt :
+      {
+        const auto& retStmnt = tree.get<ast::RetStmnt>(node);
+        if (!retStmnt.isVoid()) { nodes.pushBack(retStmnt.expr); }
+        break;
+      }
+      case ast::Kind::var_decl_stmnt :
+      {
+        nodes.pushBack(tree.get<ast::VarDeclStmnt>(node).initializer);
+        break;
+      }
+      default :
+      {
+        // Literals and types name no functions
+        break;
+      }
+    }
   }
+}
+
+/// @brief Generates main and every function it names, directly or through
+///   other functions. A body is parsed from @p tokens and resolved just
+///   before it is generated, so a function that main cannot reach is never
+///   parsed beyond its signature, nor turned into IR.
+/// @param tree a tree that @ref ast::parseSignatures parsed from @p tokens.
+///   Bodies are added to it as they are parsed.
+inline bool generateFromMain(ast::Tree& tree, const TokenStream& tokens, Unit& unit)
+{
+  IRON_TRACE(codegen, "from_main", tree.count(ast::Kind::func_defn), 0);
 
-  auto& context = llvm::getGlobalContext();
-  Builder builder { context };
-  auto module = new Module("Iron Context", llvm::getGlobalContext());
-  const bool genStatus = generate(parseTree, builder, module);
-  if (!genStatus) { assert(false); }
+  // Only the function definitions of the global namespace can be named so far
+  ast::Resolver resolver{tree};
+  if (!resolver.enter(tree.root())) { return false; }
 
-  // Output the LLVM IR code to a temporary file
-  String llFile = "/tmp/a.ll";
+  static const auto MAIN = symbols().intern("main"_ascii);
+  ast::Ref main;
+  const auto& global = tree.get<ast::Namespace>(tree.root());
+  for (auto decls = tree.list(global.decls); !decls.isEmpty() && main.isNull(); decls.pop())
   {
-    String msg;
-    llvm::raw_fd_ostream os{ llFile.c_str(), msg };
-    module->print(os, nullptr);
-    if (!msg.empty()) { errorln(msg.c_str()); assert(false); }
+    const auto decl = decls.front();
+    if (decl.kind() == ast::Kind::func_defn && tree.get<ast::FuncDefn>(decl).name == MAIN)
+    {
+      main = decl;
+    }
+  }
+  if (main.isNull())
+  {
+    errorln("There is no main function to generate code from.");
+    return false;
   }
 
-  // Compile the LLVM IR code to native assembly
-  String sFile = "/tmp/a.s";
+  // The functions still to generate. A function is declared as soon as it
+  // is named, so that calls to it resolve whether or not it has been
+  // generated yet.
+  Darray<ast::Ref> pending;
+  bool declared = true;
+  auto require = [&](ast::Ref decl)
   {
-    String cmd = "llc -o=" + sFile + " " + llFile;
-    auto code = system(cmd.c_str());
-    if (code != 0)
+    if (!declared || decl.kind() != ast::Kind::func_defn ||
+      unit.functions.count(decl.index()) > 0)
     {
-      errorln("Error converting ", llFile.c_str(), " to ", sFile.c_str());
-      assert(false);
+      return;
     }
+    declared = declare(tree, decl, unit) != nullptr;
+    pending.pushBack(decl);
+  };
+
+  require(main);
+  while (declared && !pending.isEmpty())
+  {
+    const auto funcDefn = pending.back();
+    pending.popBack();
+
+    if (!parseBody(tokens, funcDefn, tree) || !resolver.resolveBody(funcDefn)) { return false; }
+    // A name may refer to a function without calling it
+    const auto& defn = tree.get<ast::FuncDefn>(funcDefn);
+    forEachBinding(tree, defn.block, require);
+    if (!declared) { return false; }
+
+    IRON_TRACE(codegen, "func_defn", tree.pos(funcDefn).row, tree.pos(funcDefn).col);
+    if (!define(tree, defn, unit.functions.at(funcDefn.index()), unit)) { return false; }
   }
+  return declared;
+}
+
 
-  // Compile the native assembly into an executable
+/// @brief A contiguous run of function definitions that is generated,
+///   optimized and compiled into an object file on its own
+struct Partition
+{
+  /// @brief The index of the first definition
+  size_t begin;
+  /// @brief One past the index of the last definition
+  size_t end;
+};
+
+/// @brief Fewer tokens than this are not worth a module of their own
+static const size_t MIN_TOKENS_PER_PARTITION = 8192;
+static const size_t MAX_PARTITIONS = 64;
+
+/// @brief Splits @p funcDefns into runs of about the same number of body
+///   tokens.
+///
+/// The split depends only on the source, never on the number of threads, so
+/// the objects generated from a source are the same however many threads
+/// generate them.
+inline Darray<Partition> partition(const ast::Tree& tree, const Darray<ast::Ref>& funcDefns)
+{
+  // Every definition costs something, however small its body
+  auto cost = [&](size_t i) { return tree.get<ast::FuncDefn>(funcDefns.at(i)).body.count + 1; };
+
+  size_t total = 0;
+  for (size_t i=0; i<funcDefns.count(); ++i) { total += cost(i); }
+  const size_t count = std::max<size_t>(1,
+    std::min(total / MIN_TOKENS_PER_PARTITION, MAX_PARTITIONS));
+
+  Darray<Partition> partitions;
+  size_t begin = 0;
+  size_t sum = 0;
+  for (size_t i=0; i<funcDefns.count(); ++i)
   {
-    String cmd = "gcc " + sFile + " -o" + outfile;
-    auto code = system(cmd.c_str());
-    if (code != 0)
+    sum += cost(i);
+    // Cut once this partition reaches its share of the running total
+    if (sum * count >= total * (partitions.count() + 1) || i + 1 == funcDefns.count())
     {
-      errorln("Error converting ", sFile.c_str(), " to ", outfile.c_str());
-      assert(false);
+      partitions.pushBack({begin, i + 1});
+      begin = i + 1;
+    }
+  }
+  return partitions;
+}
+
+/// @brief Generates @p part of @p funcDefns into @p unit. Every function
+///   the partition names is declared first, wherever it is defined, so calls
+///   between partitions are resolved when the objects are linked.
+inline bool generatePartition(const ast::Tree& tree, const Darray<ast::Ref>& funcDefns,
+    Partition part, Unit& unit)
+{
+  for (size_t i=part.begin; i<part.end; ++i)
+  {
+    if (declare(tree, funcDefns.at(i), unit) == nullptr) { return false; }
+  }
+
+  bool declared = true;
+  for (size_t i=part.begin; i<part.end && declared; ++i)
+  {
+    forEachBinding(tree, tree.get<ast::FuncDefn>(funcDefns.at(i)).block, [&](ast::Ref decl)
+    {
+      if (declared && decl.kind() == ast::Kind::func_defn)
+      {
+        declared = declare(tree, decl, unit) != nullptr;
+      }
+    });
+  }
+  if (!declared) { return false; }
+
+  for (size_t i=part.begin; i<part.end; ++i)
+  {
+    const auto funcDefn = funcDefns.at(i);
+    IRON_TRACE(codegen, "func_defn", tree.pos(funcDefn).row, tree.pos(funcDefn).col);
+    if (!define(tree, tree.get<ast::FuncDefn>(funcDefn),
+      unit.functions.at(funcDefn.index()), unit))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// @brief The target machines of the threads that compile objects, one per
+///   thread, each made when its thread first needs it
+using Machines = std::vector<std::unique_ptr<llvm::TargetMachine>>;
+
+/// @brief Compiles @p count modules into object files in @p tempDir, on as
+///   many threads as there are @p machines.
+///
+/// Each module gets its own LLVMContext, so the threads share nothing in
+/// LLVM. @p fill(task, unit) generates module @p task into @p unit and
+/// returns false after reporting an error. Every task runs even once one
+/// fails, and the errors are reported in task order once all of them are
+/// done, so what is reported does not depend on which thread finished first.
+/// @param objFiles set to the object file of each task, or to an empty name
+///   where the task failed. The caller removes them (@ref removeObjects).
+/// @return false after reporting an error in any task
+template<typename Tfunc>
+bool compileObjects(size_t count, Machines& machines, const Optimization& optimization,
+    const String& tempDir, std::vector<String>& objFiles, Tfunc&& fill)
+{
+  enableThreads();
+  initializeTargets();
+
+  objFiles.assign(count, String{});
+  std::vector<String> errors(count);
+  std::atomic<bool> failed{false};
+  runTasks(count, machines.size(), [&](size_t task, size_t worker)
+  {
+    ErrorBuffer taskErrors;
+    auto& machine = machines[worker];
+    if (machine == nullptr) { machine.reset(createHostMachine()); }
+    llvm::LLVMContext context;
+    std::unique_ptr<Module> module{new Module("Iron Context", context)};
+    Unit unit{module.get()};
+    if (!fill(task, unit) ||
+      !optimize(module.get(), optimization) ||
+      !emitObjectFile(module.get(), machine.get(), codeGenLevel(optimization.level),
+        tempDir, objFiles[task]))
+    {
+      failed.store(true, std::memory_order_relaxed);
     }
+    errors[task] = taskErrors.take();
+  });
+
+  for (const auto& taskErrors : errors)
+  {
+    fputs(taskErrors.c_str(), (errorFile != nullptr) ? errorFile : stderr);
   }
+  return !failed.load();
 }
 
-void generate(Shared<ast::Node> parseTree)
+/// @brief Removes the object files that @ref compileObjects made
+inline void removeObjects(const std::vector<String>& objFiles)
 {
-  generate(parseTree, "./a.out");
+  for (const auto& objFile : objFiles)
+  {
+    if (!objFile.empty()) { unlink(objFile.c_str()); }
+  }
 }
 
-} // namespace iron
+/// @brief Generates, optimizes and compiles @p tree on @p threadCount
+///   threads, then links the objects into @p outfile.
+///
+/// Each partition of the functions is compiled into an object of its own
+/// by @ref compileObjects, and the objects are linked in partition order,
+/// so the output does not depend on which thread finished first.
+/// @pre @p tree is resolved
+/// @param kind Emit::object or Emit::executable, which are made of objects
+/// @param tempDir where to put the objects until they are linked
+/// @return false after reporting an error
+inline bool generateParallel(const ast::Tree& tree, String outfile, Emit kind,
+    const Optimization& optimization, size_t threadCount, const String& tempDir)
+{
+  Darray<ast::Ref> funcDefns;
+  collectFuncDefns(tree, tree.root(), funcDefns);
+  const auto partitions = partition(tree, funcDefns);
+
+  Machines machines(threadCount);
+  std::vector<String> objFiles;
+  const bool linked =
+    compileObjects(partitions.count(), machines, optimization, tempDir, objFiles,
+      [&](size_t task, Unit& unit)
+      {
+        return generatePartition(tree, funcDefns, partitions.at(task), unit);
+      }) &&
+    link(objFiles, kind, outfile);
+  removeObjects(objFiles);
+  return linked;
+}
 
+/// @brief Generates code for all of @p tree in @p context
+/// @pre @p tree is resolved
+/// @return the module, or null after reporting an error
+inline std::unique_ptr<Module> generateModule(const ast::Tree& tree,
+    llvm::LLVMContext& context)
+{
+  std::unique_ptr<Module> module{new Module("Iron Context", context)};
+  Unit unit{module.get()};
+  if (!generate(tree, unit)) { module.reset(); }
+  return module;
+}
+
+/// @brief Like generateModule, but only for the functions that main can reach
+/// @see generateFromMain
+inline std::unique_ptr<Module> generateModuleFromMain(ast::Tree& tree,
+    const TokenStream& tokens, llvm::LLVMContext& context)
+{
+  std::unique_ptr<Module> module{new Module("Iron Context", context)};
+  Unit unit{module.get()};
+  if (!generateFromMain(tree, tokens, unit)) { module.reset(); }
+  return module;
+}
+
+/// @brief Optimizes @p module and writes it to @p outfile with @p machine
+/// @param tempDir where to put the object file an executable is linked from
+/// @return false after reporting an error
+inline bool optimizeAndEmit(std::unique_ptr<Module> module, String outfile, Emit kind,
+    const Optimization& optimization, llvm::TargetMachine* machine,
+    const String& tempDir = DEFAULT_TEMP_DIR)
+{
+  if (outfile.empty())
+  {
+    errorln("Cannot compile into a nameless output file.");
+    return false;
+  }
+
+  return module != nullptr &&
+    optimize(module.get(), optimization) &&
+    emit(module.get(), kind, outfile, machine, codeGenLevel(optimization.level), tempDir);
+}
+
+/// @brief Generates code for @p tree, optimizes it and writes it to
+///   @p outfile
+/// @pre @p tree is resolved
+/// @param threadCount the number of threads to generate code with. Objects
+///   and programs are split into partitions that are compiled in parallel;
+///   the other kinds of output are written from a single module.
+/// @param tempDir where to put object files until they are linked
+/// @return false after reporting an error
+inline bool generate(const ast::Tree& tree, String outfile, Emit kind = Emit::executable,
+    const Optimization& optimization = Optimization{}, size_t threadCount = 1,
+    const String& tempDir = DEFAULT_TEMP_DIR)
+{
+  if (threadCount > 1 && !outfile.empty() &&
+    (kind == Emit::object || kind == Emit::executable))
+  {
+    return generateParallel(tree, outfile, kind, optimization, threadCount, tempDir);
+  }
+  llvm::LLVMContext context;
+  std::unique_ptr<llvm::TargetMachine> machine{
+    (kind == Emit::ll) ? nullptr : createHostMachine()};
+  return optimizeAndEmit(generateModule(tree, context), outfile, kind, optimization,
+    machine.get(), tempDir);
+}
+
+/// @brief Like generate, but only for the functions that main can reach
+/// @see generateFromMain
+inline bool generateFromMain(ast::Tree& tree, const TokenStream& tokens, String outfile,
+    Emit kind = Emit::executable, const Optimization& optimization = Optimization{},
+    const String& tempDir = DEFAULT_TEMP_DIR)
+{
+  llvm::LLVMContext context;
+  std::unique_ptr<llvm::TargetMachine> machine{
+    (kind == Emit::ll) ? nullptr : createHostMachine()};
+  return optimizeAndEmit(generateModuleFromMain(tree, tokens, context), outfile, kind,
+    optimization, machine.get(), tempDir);
+}
+
+inline bool generate(const ast::Tree& tree)
+{
+  return generate(tree, "./a.out");
+}
+
+} // namespace iron
@@ -1,15 +1,18 @@
 #pragma once
 
 // standard includes
-#include <cctype>
+#include <algorithm>
 #include <cstdio>
+#include <limits>
 #include <memory>
 #include <string>
+#include <vector>
 
 // iron includes
 #include "iron/darray.h"
 #include "iron/file.h"
 #include "iron/token.h"
+#include "iron/workers.h"
 
 namespace iron
 {
@@ -30,346 +33,434 @@ enum class LexCode
   lex_error
 };
 
-/// @brief The status code for the last run of @ref lex
-/// @todo TODO: Make this variable thread-local
-LexCode lexCode;
+/// @brief The status code for the last run of @ref lex on this thread
+extern __thread LexCode lexCode;
 
-LexCode lexExact(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos,
-    Token::Type type, Ascii str)
+/// @brief The lexing rule selected by the first byte of a token
+enum class LexRule : ubyte_t
 {
-  if (bytes.startsWith(str))
-  {
-    infoln("Lexed '", str, "' at ", pos);
-    const auto size = str.size();
-    tokens.pushBack(Token{type, pos, bytes.first(size)});
-    pos.col += size;
-    bytes.pop(size);
-    return LexCode::ok;
-  }
-  return LexCode::no_match;
-}
+  /// @brief This byte cannot start a token
+  bad,
+  /// @brief A space, tab or newline
+  whitespace,
+  /// @brief A keyword or an identifier
+  word,
+  number,
+  string_lit,
+  char_lit,
+  /// @brief A single-byte punctuation token
+  punct,
+  /// @brief '=' or the start of "=>"
+  equals
+};
 
-LexCode lexKeyword(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+/// @brief Per-byte lookup tables that drive @ref lexToken
+struct CharTable
 {
-  auto code = lexExact(tokens, bytes, pos, Token::Type::keyword_fn, "fn"_ascii);
-  if (code == LexCode::ok || code != LexCode::no_match)
+  /// @brief The rule for a token starting with a given byte
+  LexRule rules[256];
+  /// @brief The token type for a byte whose rule is LexRule::punct
+  Token::Type puncts[256];
+
+  CharTable()
   {
-    return code;
+    for (size_t i=0; i<256; ++i)
+    {
+      rules[i] = LexRule::bad;
+      puncts[i] = Token::Type::bad;
+    }
+
+    for (int c='a'; c<='z'; ++c) { rules[c] = LexRule::word; }
+    for (int c='A'; c<='Z'; ++c) { rules[c] = LexRule::word; }
+    for (int c='0'; c<='9'; ++c) { rules[c] = LexRule::number; }
+
+    rules[ubyte_t('\n')] = LexRule::whitespace;
+    rules[ubyte_t(' ')] = LexRule::whitespace;
+    rules[ubyte_t('\t')] = LexRule::whitespace;
+    rules[ubyte_t('"')] = LexRule::string_lit;
+    rules[ubyte_t('\'')] = LexRule::char_lit;
+    rules[ubyte_t('=')] = LexRule::equals;
+
+    setPunct('{', Token::Type::left_brace);
+    setPunct('}', Token::Type::right_brace);
+    setPunct('(', Token::Type::left_paren);
+    setPunct(')', Token::Type::right_paren);
+    setPunct('[', Token::Type::left_bracket);
+    setPunct(']', Token::Type::right_bracket);
+    setPunct(',', Token::Type::comma);
+    setPunct('.', Token::Type::period);
+    setPunct(':', Token::Type::colon);
+    setPunct(';', Token::Type::semicolon);
+    setPunct('-', Token::Type::minus);
+    setPunct('+', Token::Type::plus);
+    setPunct('*', Token::Type::asterisk);
+    setPunct('!', Token::Type::bang);
+    setPunct('<', Token::Type::less_than);
+    setPunct('>', Token::Type::greater_than);
+    setPunct('/', Token::Type::fwd_slash);
+    setPunct('\\', Token::Type::back_slash);
+    setPunct('|', Token::Type::pipe);
+    setPunct('?', Token::Type::question);
+    setPunct('@', Token::Type::at);
+    setPunct('$', Token::Type::dollar);
+    setPunct('%', Token::Type::percent);
+    setPunct('^', Token::Type::caret);
+    setPunct('&', Token::Type::ampersind);
+    setPunct('#', Token::Type::octothorpe);
+    setPunct('~', Token::Type::tilde);
+    setPunct('`', Token::Type::back_tick);
   }
-  code = lexExact(tokens, bytes, pos, Token::Type::keyword_ret, "ret"_ascii);
-  if (code == LexCode::ok || code != LexCode::no_match)
+
+  LexRule rule(byte_t c) const { return rules[ubyte_t(c)]; }
+  Token::Type punct(byte_t c) const { return puncts[ubyte_t(c)]; }
+
+private :
+  void setPunct(char c, Token::Type type)
   {
-    return code;
+    rules[ubyte_t(c)] = LexRule::punct;
+    puncts[ubyte_t(c)] = type;
   }
-  return LexCode::no_match;
-}
+};
 
-LexCode lexIdentifier(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+/// @brief The lexer's character classes. These are plain ASCII and do not
+///   depend on the C locale, unlike isalpha and friends.
+const CharTable charTable;
+
+/// @brief Chooses between a keyword and an identifier for a complete word
+inline Token::Type wordType(Ascii word)
 {
-  size_t size = 0;
-  auto c = bytes.at(size);
-  while (size < bytes.size() &&
-      (isalnum(c) || c == '_'))
-  {
-    ++size;
-    c = bytes.at(size);
-  }
-  if (size > 0)
+  switch (word.size())
   {
-    auto substr = bytes.first(size);
-    bytes.pop(size);
-    infoln("Lexed '", substr, "' as a symbol at ", pos);
-    tokens.pushBack(Token{Token::Type::identifier, pos, substr});
-    pos.col += size;
-    return LexCode::ok;
+    case 2 :
+    {
+      if (word.startsWith("fn"_ascii)) { return Token::Type::keyword_fn; }
+      break;
+    }
+    case 3 :
+    {
+      if (word.startsWith("ret"_ascii)) { return Token::Type::keyword_ret; }
+      break;
+    }
+    default :
+    {
+      break;
+    }
   }
-  return LexCode::no_match;
+  return Token::Type::identifier;
 }
 
-LexCode lexNumberLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+/// @brief Moves the first @p size bytes of @p bytes into a new token
+/// @param begin the start of the file that @p bytes is part of
+inline LexCode pushToken(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin, Token::Type type, size_t size)
 {
-  size_t size = 0;
-  auto c = bytes.at(size);
-  while (size < bytes.size() && isdigit(c))
-  {
-    ++size;
-    c = bytes.at(size);
-  }
-  if (size > 0)
+  const auto offset = static_cast<uint32_t>(&bytes.front() - begin);
+  if (size > std::numeric_limits<uint16_t>::max())
   {
-    auto substr = bytes.first(size);
-    bytes.pop(size);
-    infoln("Lexed '", substr, "' as a number at ", pos);
-    tokens.pushBack(Token{Token::Type::number, pos, substr});
-    pos.col += size;
-    return LexCode::ok;
+    errorln("The token at offset ", size_t(offset), " is ", size,
+      " bytes long. Tokens may be at most ",
+      size_t(std::numeric_limits<uint16_t>::max()), " bytes long.");
+    return LexCode::lex_error;
   }
-  return LexCode::no_match;
-  (void) tokens; (void) bytes; (void) pos;
-  return LexCode::no_match;
+
+  tokens.pushBack(Token{offset, static_cast<uint16_t>(size), type});
+  bytes.pop(size);
+  return LexCode::ok;
 }
 
-LexCode lexStringLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+inline LexCode lexWord(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin)
 {
-  (void) tokens; (void) bytes; (void) pos;
-  return LexCode::no_match;
+  auto rest = bytes;
+  rest.pop();
+  const size_t size = 1 + findFirstNotIn(rest, ByteClass::word);
+
+  const auto type = wordType(bytes.first(size));
+  IRON_TRACE(lex, (type == Token::Type::identifier) ? "symbol" : "keyword",
+    &bytes.front() - begin, size);
+  return pushToken(tokens, bytes, begin, type, size);
+}
+
+inline LexCode lexNumberLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin)
+{
+  auto rest = bytes;
+  rest.pop();
+  const size_t size = 1 + findFirstNotIn(rest, ByteClass::digit);
+
+  IRON_TRACE(lex, "number", &bytes.front() - begin, size);
+  return pushToken(tokens, bytes, begin, Token::Type::number, size);
 }
 
-LexCode lexCharLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+/// @brief Consumes a whole run of spaces, tabs and newlines at once
+inline LexCode lexWhitespace(PtrRange<const byte_t>& bytes, const byte_t* begin)
 {
-  (void) tokens; (void) bytes; (void) pos;
+  (void) begin; // only used for tracing
+  const auto size = skipWhitespace(bytes);
+  IRON_TRACE(lex, "whitespace", &bytes.front() - begin, size);
+  bytes.pop(size);
+  return LexCode::ok;
+}
+
+inline LexCode lexStringLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin)
+{
+  (void) tokens; (void) bytes; (void) begin;
   return LexCode::no_match;
 }
 
-LexCode lexSingleChar(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos,
-  char c, Token::Type type)
+inline LexCode lexCharLiteral(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin)
 {
-  if (bytes.front() == c)
-  {
-    infoln("Lexed a '", c, "' at ", pos);
-    tokens.pushBack(Token{type, pos, bytes.first(1)});
-    ++pos.col;
-    bytes.pop();
-    return LexCode::ok;
-  }
+  (void) tokens; (void) bytes; (void) begin;
   return LexCode::no_match;
 }
 
-LexCode lexPunctuation(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+inline LexCode lexPunct(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin, Token::Type type, size_t size)
 {
-  auto code = lexSingleChar(tokens, bytes, pos, '{', Token::Type::left_brace);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '}', Token::Type::right_brace);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '(', Token::Type::left_paren);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, ')', Token::Type::right_paren);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '[', Token::Type::left_bracket);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, ']', Token::Type::right_bracket);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexExact(tokens, bytes, pos, Token::Type::map, "=>"_ascii);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, ',', Token::Type::comma);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '.', Token::Type::period);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, ':', Token::Type::colon);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, ';', Token::Type::semicolon);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '-', Token::Type::minus);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '+', Token::Type::plus);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '*', Token::Type::asterisk);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '!', Token::Type::bang);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '=', Token::Type::equals);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '<', Token::Type::less_than);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '>', Token::Type::greater_than);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '/', Token::Type::fwd_slash);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '\\', Token::Type::back_slash);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '|', Token::Type::pipe);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '?', Token::Type::question);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '@', Token::Type::at);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '$', Token::Type::dollar);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '%', Token::Type::percent);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '^', Token::Type::caret);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '&', Token::Type::ampersind);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '#', Token::Type::octothorpe);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '~', Token::Type::tilde);
-  if (code == LexCode::ok || code != LexCode::no_match)
-  {
-    return code;
-  }
-  code = lexSingleChar(tokens, bytes, pos, '`', Token::Type::back_tick);
-  if (code == LexCode::ok || code != LexCode::no_match)
+  IRON_TRACE(lex, "punctuation", &bytes.front() - begin, size);
+  return pushToken(tokens, bytes, begin, type, size);
+}
+
+/// @pre @p bytes is not empty
+inline LexCode lexToken(Darray<Token>& tokens, PtrRange<const byte_t>& bytes,
+  const byte_t* begin)
+{
+  const auto c = bytes.front();
+  switch (charTable.rule(c))
   {
-    return code;
+    case LexRule::whitespace :
+    {
+      return lexWhitespace(bytes, begin);
+    }
+    case LexRule::word :
+    {
+      return lexWord(tokens, bytes, begin);
+    }
+    case LexRule::number :
+    {
+      return lexNumberLiteral(tokens, bytes, begin);
+    }
+    case LexRule::string_lit :
+    {
+      return lexStringLiteral(tokens, bytes, begin);
+    }
+    case LexRule::char_lit :
+    {
+      return lexCharLiteral(tokens, bytes, begin);
+    }
+    case LexRule::punct :
+    {
+      return lexPunct(tokens, bytes, begin, charTable.punct(c), 1);
+    }
+    case LexRule::equals :
+    {
+      // One byte of lookahead distinguishes '=' from "=>"
+      if (bytes.size() > 1 && bytes.at(1) == '>')
+      {
+        return lexPunct(tokens, bytes, begin, Token::Type::map, 2);
+      }
+      return lexPunct(tokens, bytes, begin, Token::Type::equals, 1);
+    }
+    case LexRule::bad :
+    {
+      break;
+    }
   }
 
   return LexCode::no_match;
 }
 
-LexCode lexToken(Darray<Token>& tokens, PtrRange<const byte_t>& bytes, Pos& pos)
+/// @brief Whether a token chosen by @p rule always ends on the line where it
+///   starts. A file can only be lexed in newline-aligned chunks if every
+///   token in it is line-local.
+///
+/// When a construct that can span lines lands (string literals with escaped
+/// newlines, block comments, ...), its rule must return false here. A chunk
+/// that meets such a token gives up and @ref lex falls back to a serial pass
+/// over the whole file.
+inline bool isLineLocal(LexRule rule)
 {
-  (void) tokens; (void) bytes; (void) pos;
-  const auto& c = bytes.front();
-  if (c == '\n')
-  {
-    infoln("Lexed a newline at ", pos);
-    ++pos.row;
-    pos.col = 1;
-    bytes.pop();
-    return LexCode::ok;
-  }
-  else if (c == ' ' || c == '\t')
-  {
-    infoln("Lexed whitespace at ", pos);
-    ++pos.col;
-    bytes.pop();
-    return LexCode::ok;
-  }
-  else if (isalpha(c))
+  switch (rule)
   {
-    const auto lexKeywordCode = lexKeyword(tokens, bytes, pos);
-    if (lexKeywordCode == LexCode::ok ||
-        lexKeywordCode != LexCode::no_match)
+    case LexRule::string_lit :
+    case LexRule::char_lit :
     {
-      return lexKeywordCode;
+      return false;
     }
-
-    const auto lexIdentifierCode = lexIdentifier(tokens, bytes, pos);
-    if (lexIdentifierCode == LexCode::ok ||
-        lexIdentifierCode != LexCode::no_match)
+    default :
     {
-      return lexIdentifierCode;
+      return true;
     }
-
-    errorln("Token at ", pos, " starts with an alphabet character, so it "
-      "should be a keyword or an identifier.");
-  }
-  else if (isdigit(c))
-  {
-    return lexNumberLiteral(tokens, bytes, pos);
   }
-  else if (c == '\"')
+}
+
+/// @brief Lexes one newline-aligned chunk of a file
+/// @return LexCode::no_match if the chunk holds a token that is not
+///   line-local, or one that fails to lex. Either way the caller should
+///   re-lex serially, which also produces the right diagnostic.
+inline LexCode lexChunk(Darray<Token>& tokens, PtrRange<const byte_t> bytes,
+  const byte_t* begin)
+{
+  while (!bytes.isEmpty())
   {
-    return lexStringLiteral(tokens, bytes, pos);
+    if (!isLineLocal(charTable.rule(bytes.front())))
+    {
+      return LexCode::no_match;
+    }
+
+    const auto code = lexToken(tokens, bytes, begin);
+    if (code == LexCode::lex_error) { return code; }
+    if (code != LexCode::ok) { return LexCode::no_match; }
   }
-  else if (c == '\'')
-  {
-    return lexCharLiteral(tokens, bytes, pos);
+  return LexCode::ok;
+}
+
+/// @brief A rough lower bound on the bytes of source per token, used to size
+///   token arrays up front
+static const size_t BYTES_PER_TOKEN = 4;
+
+/// @brief Below this many bytes per thread, starting threads costs more than
+///   it saves
+static const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+/// @brief Lexes @p bytes on @p threadCount threads, splitting it after
+///   newlines
+inline LexCode lexParallel(Darray<Token>& tokens, PtrRange<const byte_t> bytes,
+  size_t threadCount)
+{
+  const byte_t* begin = &bytes.front();
+  const byte_t* end = begin + bytes.size();
+
+  // Split after the first newline past each even share of the file. A chunk
+  // may come out empty when a line is longer than a share.
+  std::vector<PtrRange<const byte_t>> chunks;
+  const byte_t* chunkBegin = begin;
+  for (size_t i=1; i<=threadCount; ++i)
+  {
+    const byte_t* chunkEnd = end;
+    if (i < threadCount)
+    {
+      const byte_t* target = std::max(chunkBegin, begin + bytes.size() * i / threadCount);
+      auto newline = static_cast<const byte_t*>(memchr(target, '\n', end - target));
+      chunkEnd = (newline != nullptr) ? (newline + 1) : end;
+    }
+    if (chunkEnd > chunkBegin)
+    {
+      chunks.push_back({chunkBegin, chunkEnd - 1});
+    }
+    chunkBegin = chunkEnd;
   }
-  else
+
+  infoln("Lexing in ", chunks.size(), " chunks");
+  std::vector<Darray<Token>> results(chunks.size());
+  std::vector<LexCode> codes(chunks.size(), LexCode::ok);
+  // A chunk per thread. The threads report errors as this one does.
+  runTasks(chunks.size(), chunks.size(), [&](size_t i, size_t)
+  {
+    results[i].reserve(chunks[i].size() / BYTES_PER_TOKEN);
+    codes[i] = lexChunk(results[i], chunks[i], begin);
+  });
+
+  auto code = LexCode::ok;
+  for (auto chunkCode : codes)
   {
-    return lexPunctuation(tokens, bytes, pos);
+    if (chunkCode == LexCode::lex_error) { return chunkCode; }
+    if (chunkCode != LexCode::ok) { code = chunkCode; }
   }
+  if (code != LexCode::ok) { return code; }
 
-  return LexCode::no_match;
+  // Offsets are relative to the start of the file, so the chunks' tokens
+  // can be concatenated as they are.
+  size_t total = 0;
+  for (auto& result : results) { total += result.count(); }
+  tokens.reserve(total);
+  for (auto& result : results)
+  {
+    for (auto chunkTokens = result.all(); !chunkTokens.isEmpty(); chunkTokens.pop())
+    {
+      tokens.pushBack(chunkTokens.front());
+    }
+  }
+  return LexCode::ok;
 }
 
 /// @brief Breaks a file up into Tokens
-Darray<Token> lex(Shared<File> file)
+///
+/// Source validation is fused into this pass rather than done up front with
+/// File::isValid. NUL and non-ASCII bytes cannot start a token and every run
+/// scanner stops at them, so an invalid byte always surfaces here as a token
+/// that failed to lex.
+///
+/// Rows and columns are not tracked here. Tokens only record their offsets,
+/// and TokenStream::pos recovers positions when they are asked for.
+///
+/// @param threadCount the number of threads to lex with. Only large files are
+///   split, and only when every token in them is line-local (@ref
+///   isLineLocal). Otherwise, the file is lexed serially.
+inline TokenStream lex(Shared<File> file, size_t threadCount = 1)
 {
   lexCode = LexCode::bad_file;
 
-  if (file->isEmpty() || file->isValid() == false)
+  if (file->isEmpty())
+  {
+    return {};
+  }
+  if (file->size() > std::numeric_limits<uint32_t>::max())
   {
+    lexCode = LexCode::lex_error;
+    errorln("'", file->path(), "' is ", file->size(), " bytes long. Files may "
+      "be at most ", size_t(std::numeric_limits<uint32_t>::max()),
+      " bytes long.");
     return {};
   }
 
-  Darray<Token> tokens;
   infoln("Lexing '", file->path());
-  auto bytes = file->all();
-  infoln("Read ", bytes.size(), " bytes from '", file->path(), "'");
-  Pos pos = {1, 1};
+  const auto all = file->all();
+  const byte_t* begin = &all.at(0);
+  infoln("Read ", all.size(), " bytes from '", file->path(), "'");
+
+  threadCount = std::min(threadCount, all.size() / MIN_CHUNK_SIZE);
+  if (threadCount > 1)
+  {
+    Darray<Token> tokens;
+    const auto code = lexParallel(tokens, all, threadCount);
+    if (code == LexCode::ok)
+    {
+      lexCode = LexCode::ok;
+      return {file, std::move(tokens)};
+    }
+    if (code == LexCode::lex_error)
+    {
+      lexCode = code;
+      return {};
+    }
+    infoln("Falling back to lexing '", file->path(), "' serially");
+  }
+
+  Darray<Token> tokens;
+  tokens.reserve(all.size() / BYTES_PER_TOKEN);
+  auto bytes = all;
   while (!bytes.isEmpty())
   {
-    infoln("Attempting to lex a token at ", file->path(), ':', pos);
-    const auto code = lexToken(tokens, bytes, pos);
+    const auto code = lexToken(tokens, bytes, begin);
     if (code != LexCode::ok)
     {
+      // This is the cold path, so only now work out the row and column
+      LineTable lines;
+      lines.build(all);
+      const auto offset = static_cast<uint32_t>(&bytes.front() - begin);
+      const auto pos = lines.pos(offset);
+
+      if (findInvalid(bytes, Encoding::ascii) == 0)
+      {
+        lexCode = LexCode::bad_file;
+        errorln("Invalid byte ", size_t(ubyte_t(bytes.front())), " at offset ",
+          size_t(offset), " (", file->path(), ':', pos, ")");
+        return {};
+      }
+
       lexCode = code;
       errorln("Failed to lex a token at ", file->path(), ':', pos);
       return {};
@@ -378,8 +469,95 @@ Darray<Token> lex(Shared<File> file)
 
   // Report a successful lex
   lexCode = LexCode::ok;
-  return std::move(tokens);
+  return {file, std::move(tokens)};
 }
 
-} // namespace iron
+/// @brief Lexes @p file, which is the file of @p old after an edit, by
+///   lexing only the bytes around what changed.
+///
+/// The bytes that both versions start with and end with are found first.
+/// Tokens that end before the edit are kept as they are. Lexing starts
+/// after them, and stops as soon as it reaches the start of a token that
+/// lies wholly in the unchanged end: lexing depends on nothing but where it
+/// starts, so from there on it would produce the tokens of @p old again,
+/// moved by the change in size. Those are copied instead.
+///
+/// Falls back to @ref lex when the edit cannot be lexed, so that it
+/// reports the error.
+inline TokenStream relex(const TokenStream& old, Shared<File> file)
+{
+  const auto oldTokens = old.all();
+  if (old.isEmpty() || old.file()->isEmpty() || file->isEmpty() ||
+    file->size() > std::numeric_limits<uint32_t>::max())
+  {
+    return lex(file);
+  }
 
+  const auto oldBytes = old.file()->all();
+  const auto newBytes = file->all();
+  const byte_t* oldBegin = &oldBytes.at(0);
+  const byte_t* begin = &newBytes.at(0);
+  const size_t oldSize = oldBytes.size();
+  const size_t newSize = newBytes.size();
+  const size_t limit = std::min(oldSize, newSize);
+  size_t prefix = 0;
+  while (prefix < limit && oldBegin[prefix] == begin[prefix]) { ++prefix; }
+  size_t suffix = 0;
+  while (suffix < limit - prefix &&
+    oldBegin[oldSize - 1 - suffix] == begin[newSize - 1 - suffix])
+  {
+    ++suffix;
+  }
+
+  // A token that ends right where the edit starts may grow into it
+  size_t kept = 0;
+  while (kept < oldTokens.size() &&
+    oldTokens.at(kept).offset + oldTokens.at(kept).size < prefix)
+  {
+    ++kept;
+  }
+
+  Darray<Token> tokens;
+  tokens.reserve(oldTokens.size() + newSize / BYTES_PER_TOKEN / 8);
+  for (size_t i=0; i<kept; ++i) { tokens.pushBack(oldTokens.at(i)); }
+
+  const size_t start = (kept == 0) ? 0 :
+    (oldTokens.at(kept - 1).offset + oldTokens.at(kept - 1).size);
+  const int64_t shift = int64_t(newSize) - int64_t(oldSize);
+  // The first token of @p old that lies wholly in the unchanged end
+  size_t next = kept;
+  while (next < oldTokens.size() && oldTokens.at(next).offset < oldSize - suffix) { ++next; }
+
+  PtrRange<const byte_t> bytes{begin + start, begin + newSize - 1};
+  bool isSynced = false;
+  while (!bytes.isEmpty())
+  {
+    const auto at = static_cast<int64_t>(&bytes.front() - begin);
+    while (next < oldTokens.size() && oldTokens.at(next).offset + shift < at) { ++next; }
+    if (next < oldTokens.size() && oldTokens.at(next).offset + shift == at)
+    {
+      isSynced = true;
+      break;
+    }
+
+    if (lexToken(tokens, bytes, begin) != LexCode::ok)
+    {
+      infoln("Relexing '", file->path(), "' from the start");
+      return lex(file);
+    }
+  }
+
+  IRON_TRACE(lex, "relex", (isSynced ? size_t(&bytes.front() - begin) : newSize) - start,
+    isSynced ? oldTokens.size() - next : 0);
+  for (; isSynced && next < oldTokens.size(); ++next)
+  {
+    auto token = oldTokens.at(next);
+    token.offset = static_cast<uint32_t>(token.offset + shift);
+    tokens.pushBack(token);
+  }
+
+  lexCode = LexCode::ok;
+  return {file, std::move(tokens)};
+}
+
+} // namespace iron
@@ -0,0 +1,220 @@
+#pragma once
+
+// standard includes
+#include <string>
+
+// iron includes
+#include "iron/print.h"
+
+// third-party includes
+#include "llvm/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/StandardPasses.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Scalar.h"
+
+namespace iron
+{
+
+/// @brief How hard to optimize, as in -O0, -O1, -O2, -O3 and -Os
+enum class OptLevel : ubyte_t
+{
+  O0,
+  O1,
+  O2,
+  O3,
+  Os
+};
+
+struct Optimization
+{
+  OptLevel level = OptLevel::O0;
+  /// @brief When not empty, a comma-separated list of passes to run instead
+  ///   of the ones @ref level picks. Code generation still follows
+  ///   @ref level.
+  std::string passes;
+};
+
+/// @brief Reads the argument of -O: 0, 1, 2, 3 or s
+/// @return false if @p text names none of them
+inline bool toOptLevel(const std::string& text, OptLevel& level)
+{
+  if (text == "0") { level = OptLevel::O0; }
+  else if (text == "1") { level = OptLevel::O1; }
+  else if (text == "2") { level = OptLevel::O2; }
+  else if (text == "3") { level = OptLevel::O3; }
+  else if (text == "s") { level = OptLevel::Os; }
+  else { return false; }
+  return true;
+}
+
+/// @return how hard the code generator should work at @p level. -O0 only
+///   leaves out the IR passes: the code generator works as hard as llc does
+///   by default, as it did before there were levels.
+inline llvm::CodeGenOpt::Level codeGenLevel(OptLevel level)
+{
+  switch (level)
+  {
+    case OptLevel::O1 :
+    {
+      return llvm::CodeGenOpt::Less;
+    }
+    case OptLevel::O3 :
+    {
+      return llvm::CodeGenOpt::Aggressive;
+    }
+    default :
+    {
+      return llvm::CodeGenOpt::Default;
+    }
+  }
+}
+
+/// @brief A pass that can be named in a custom pass list, by the name opt
+///   knows it by
+struct NamedPass
+{
+  const char* name;
+  llvm::Pass* (*create)();
+};
+
+static const NamedPass NAMED_PASSES[] =
+{
+  {"adce", []() -> llvm::Pass* { return llvm::createAggressiveDCEPass(); }},
+  {"constprop", []() -> llvm::Pass* { return llvm::createConstantPropagationPass(); }},
+  {"dse", []() -> llvm::Pass* { return llvm::createDeadStoreEliminationPass(); }},
+  {"globaldce", []() -> llvm::Pass* { return llvm::createGlobalDCEPass(); }},
+  {"globalopt", []() -> llvm::Pass* { return llvm::createGlobalOptimizerPass(); }},
+  {"gvn", []() -> llvm::Pass* { return llvm::createGVNPass(); }},
+  {"indvars", []() -> llvm::Pass* { return llvm::createIndVarSimplifyPass(); }},
+  {"inline", []() -> llvm::Pass* { return llvm::createFunctionInliningPass(); }},
+  {"instcombine", []() -> llvm::Pass* { return llvm::createInstructionCombiningPass(); }},
+  {"ipsccp", []() -> llvm::Pass* { return llvm::createIPSCCPPass(); }},
+  {"jump-threading", []() -> llvm::Pass* { return llvm::createJumpThreadingPass(); }},
+  {"licm", []() -> llvm::Pass* { return llvm::createLICMPass(); }},
+  {"loop-deletion", []() -> llvm::Pass* { return llvm::createLoopDeletionPass(); }},
+  {"loop-rotate", []() -> llvm::Pass* { return llvm::createLoopRotatePass(); }},
+  {"loop-unroll", []() -> llvm::Pass* { return llvm::createLoopUnrollPass(); }},
+  {"mem2reg", []() -> llvm::Pass* { return llvm::createPromoteMemoryToRegisterPass(); }},
+  {"memcpyopt", []() -> llvm::Pass* { return llvm::createMemCpyOptPass(); }},
+  {"reassociate", []() -> llvm::Pass* { return llvm::createReassociatePass(); }},
+  {"sccp", []() -> llvm::Pass* { return llvm::createSCCPPass(); }},
+  {"simplifycfg", []() -> llvm::Pass* { return llvm::createCFGSimplificationPass(); }},
+  {"tailcallelim", []() -> llvm::Pass* { return llvm::createTailCallEliminationPass(); }}
+};
+
+/// @return the pass called @p name, or null if there is none
+inline llvm::Pass* createPass(const std::string& name)
+{
+  for (const auto& pass : NAMED_PASSES)
+  {
+    if (name == pass.name) { return pass.create(); }
+  }
+  return nullptr;
+}
+
+/// @brief Adds the passes of the comma-separated list @p passes to
+///   @p manager, in order
+/// @return false after reporting a name that is not a known pass
+inline bool addPasses(const std::string& passes, llvm::PassManager& manager)
+{
+  size_t begin = 0;
+  while (begin <= passes.size())
+  {
+    auto end = passes.find(',', begin);
+    if (end == std::string::npos) { end = passes.size(); }
+
+    const auto name = passes.substr(begin, end - begin);
+    auto pass = createPass(name);
+    if (pass == nullptr)
+    {
+      std::string known;
+      for (const auto& namedPass : NAMED_PASSES)
+      {
+        known += known.empty() ? "" : ", ";
+        known += namedPass.name;
+      }
+      errorln("There is no pass named '", name, "'. The known passes are ", known);
+      return false;
+    }
+    manager.add(pass);
+
+    begin = end + 1;
+  }
+  return true;
+}
+
+/// @brief Runs the per-function and then the whole-module passes that opt
+///   runs at the same level: mem2reg, instcombine, GVN, inlining, the loop
+///   passes and so on
+inline void runStandardPasses(OptLevel level, llvm::Module* module)
+{
+  const bool optimizeSize = (level == OptLevel::Os);
+  const unsigned number = optimizeSize ? 2 : static_cast<unsigned>(level);
+
+  llvm::FunctionPassManager functionPasses{module};
+  llvm::createStandardFunctionPasses(&functionPasses, number);
+  functionPasses.doInitialization();
+  for (auto fn = module->begin(); fn != module->end(); ++fn)
+  {
+    if (!fn->isDeclaration()) { functionPasses.run(*fn); }
+  }
+  functionPasses.doFinalization();
+
+  // The inlining thresholds are the ones opt uses for each level
+  llvm::Pass* inliner = nullptr;
+  switch (level)
+  {
+    case OptLevel::O1 :
+    {
+      inliner = llvm::createAlwaysInlinerPass();
+      break;
+    }
+    case OptLevel::Os :
+    {
+      inliner = llvm::createFunctionInliningPass(75);
+      break;
+    }
+    case OptLevel::O3 :
+    {
+      inliner = llvm::createFunctionInliningPass(275);
+      break;
+    }
+    default :
+    {
+      inliner = llvm::createFunctionInliningPass(225);
+      break;
+    }
+  }
+
+  llvm::PassManager modulePasses;
+  static const bool UNIT_AT_A_TIME = true;
+  static const bool SIMPLIFY_LIB_CALLS = true;
+  static const bool HAVE_EXCEPTIONS = false;
+  llvm::createStandardModulePasses(&modulePasses, number, optimizeSize,
+    UNIT_AT_A_TIME, level > OptLevel::O1 && !optimizeSize, SIMPLIFY_LIB_CALLS,
+    HAVE_EXCEPTIONS, inliner);
+  modulePasses.run(*module);
+}
+
+/// @brief Optimizes @p module as @p optimization says
+/// @return false after reporting an error
+inline bool optimize(llvm::Module* module, const Optimization& optimization)
+{
+  if (!optimization.passes.empty())
+  {
+    llvm::PassManager passes;
+    if (!addPasses(optimization.passes, passes)) { return false; }
+    passes.run(*module);
+    return true;
+  }
+
+  if (optimization.level != OptLevel::O0)
+  {
+    runStandardPasses(optimization.level, module);
+  }
+  return true;
+}
+
+} // namespace iron
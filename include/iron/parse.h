@@ -1,8 +1,16 @@
 #pragma once
 
+// standard includes
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
 // iron includes
 #include "iron/ast.h"
 #include "iron/token.h"
+#include "iron/workers.h"
 
 namespace iron
 {
@@ -10,66 +18,71 @@ namespace iron
 namespace ast
 {
 
-using Tokens = PtrRange<Token>;
+using Tokens = TokenRange;
+
+// Every parse function returns a null Ref when the tokens do not match, and
+// only adds nodes to the tree once it has committed to a match. Children are
+// added before their parents.
+//
+// Where a rule has alternatives, the parser picks one by looking at a fixed
+// number of upcoming tokens (never more than three) and then commits to it,
+// instead of trying each alternative in turn. That way every token is
+// examined a bounded number of times. Lookahead goes through
+// TokenRange::type, which reads past the end as Token::Type::bad.
 
-Shared<Typename> parseTypename(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseTypename(Tokens& tokens, Ref nspace, Tree& tree)
 {
   (void) nspace;
 
-  if (tokens.front().type != Token::Type::identifier)
+  if (tokens.type() != Token::Type::identifier)
   {
     return {};
   }
-  auto tname = std::make_shared<Typename>(tokens.front().pos);
+  auto tname = tree.add(tokens.pos(), Typename{});
   tokens.pop();
 
   return tname;
 }
 
-Shared<VarDecl> parseVarDecl(Tokens& tokens, Shared<Namespace> nspace);
+Ref parseVarDecl(Tokens& tokens, Ref nspace, Tree& tree);
 
-Shared<FuncType> parseFuncType(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseFuncType(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  (void) nspace;
-
   auto remainder = tokens;
 
   // TODO: Generalize ins to be a parentheses-grouped list of variable
   // declarations.
-  if (remainder[0].type != Token::Type::left_paren &&
-      remainder[1].type != Token::Type::right_paren)
+  if (remainder.type(0) != Token::Type::left_paren ||
+      remainder.type(1) != Token::Type::right_paren ||
+      remainder.type(2) != Token::Type::map)
   {
     return {};
   }
   remainder.pop(2);
 
-  if (remainder.front().type != Token::Type::map)
-  {
-    return {};
-  }
-
   // At this point, it's safe to assume that this is a function type
-  auto funcType = std::make_shared<FuncType>(remainder.front().pos);
+  const Pos pos = remainder.pos();
   remainder.pop();
 
   // Start parsing the return types
-  if (remainder[0].type != Token::Type::left_paren)
+  if (remainder.type(0) != Token::Type::left_paren)
   {
-    errorln("Expected a return argument list at ", remainder.front().pos);
+    errorln("Expected a return argument list at ", remainder.pos());
     return {};
   }
   remainder.pop();
 
   // TODO: while not ')', parse comma-separated variable declarations
+  Tree::ListBuilder outs{tree};
   bool expectComma = false;
-  while (remainder.front().type != Token::Type::right_paren)
+  while (remainder.type() != Token::Type::right_paren)
   {
     if (expectComma)
     {
-      if (remainder.front().type != Token::Type::comma)
+      if (remainder.type() != Token::Type::comma)
       {
         errorln("Expected a comma as part of a parameter list at ",
-          remainder.front().pos);
+          remainder.pos());
         return {};
       }
 
@@ -77,440 +90,538 @@ Shared<FuncType> parseFuncType(Tokens& tokens, Shared<Namespace> nspace)
     }
 
     // else expect a variable declaration
-    auto varDecl = parseVarDecl(remainder, nspace);
+    auto varDecl = parseVarDecl(remainder, nspace, tree);
     if (!varDecl)
     {
       errorln("Expected a variable declaration as part of a parameter "
-          "list at ", remainder.front().pos);
+          "list at ", remainder.pos());
       return {};
     }
-    funcType->outs.pushBack(varDecl);
+    outs.add(varDecl);
 
     expectComma = true;
   }
   remainder.pop(); // Pops the right parenthesis
 
+  FuncType funcType{};
+  funcType.outs = outs.commit();
+
   tokens = remainder;
-  return funcType;
+  return tree.add(pos, funcType);
 }
 
-Shared<Type> parseType(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseType(Tokens& tokens, Ref nspace, Tree& tree)
 {
+  switch (tokens.type())
   {
-    auto fnType = parseFuncType(tokens, nspace);
-    if (fnType) { return fnType; }
+    case Token::Type::left_paren :
+    {
+      return parseFuncType(tokens, nspace, tree);
+    }
+    case Token::Type::identifier :
+    {
+      return parseTypename(tokens, nspace, tree);
+    }
+    default :
+    {
+      return {};
+    }
   }
+}
 
+/// @brief Converts base 10 @p digits to a number
+/// @return false if the number does not fit in 64 bits
+inline bool toUint64(Ascii digits, uint64_t& value)
+{
+  value = 0;
+  for (size_t i=0; i<digits.size(); ++i)
   {
-    auto tname = parseTypename(tokens, nspace);
-    if (tname) { return tname; }
+    const uint64_t digit = digits.at(i) - '0';
+    if (value > (UINT64_MAX - digit) / 10) { return false; }
+    value = value * 10 + digit;
   }
-
-  return {};
+  return true;
 }
 
-Shared<NumLit> parseNumberLit(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseNumberLit(Tokens& tokens, Ref nspace, Tree& tree)
 {
   (void) nspace; // TODO: Scope literals?
 
   auto remainder = tokens;
-  const Pos pos = remainder.front().pos;
+  const Pos pos = remainder.pos();
 
   // TODO: Optional sign
-  const bool isNeg = (remainder.front().type == Token::Type::minus);
+  const bool isNeg = (remainder.type() == Token::Type::minus);
   if (isNeg) { remainder.pop(); }
 
   // Mandatory number
-  if (remainder.front().type != Token::Type::number)
+  if (remainder.type() != Token::Type::number)
   {
     return {};
   }
   // It is now safe to assume that this is some sort of number literal
-  auto& intPart = remainder.front().value;
+  const auto intPart = remainder.value();
   remainder.pop();
 
   // A period indicates a float literal
-  const bool isFloat = (remainder.front().type == Token::Type::period);
+  const bool isFloat = (remainder.type() == Token::Type::period);
 
-  Shared<NumLit> numberLit;
+  std::string floatText;
   if (isFloat)
   {
     remainder.pop();
-    auto floatLit = std::make_shared<FloatLit>(pos);
+    floatText.assign(&intPart.at(0), intPart.size());
+    floatText += '.';
 
     // Optional number following the decimal point
-    if (remainder.front().type == Token::Type::number)
+    if (remainder.type() == Token::Type::number)
     {
-      floatLit->floatPart = remainder.front().value;
+      auto floatPart = remainder.value();
+      floatText.append(&floatPart.at(0), floatPart.size());
       remainder.pop();
     }
   }
-  else
-  {
-    numberLit = std::make_shared<IntLit>(pos);
-  }
-  numberLit->isNeg = isNeg;
-  numberLit->intPart = intPart;
 
-  if (remainder.front().type == Token::Type::colon)
+  Ref type;
+  if (remainder.type() == Token::Type::colon)
   {
     // It is now safe to assume that this number literal has a suffix
-    const auto colonPos = remainder.front().pos;
+    const auto colonPos = remainder.pos();
     remainder.pop();
 
-    numberLit->type = parseType(remainder, nspace);
-    if (!numberLit)
+    type = parseType(remainder, nspace, tree);
+    if (!type)
     {
       errorln("Expected a type following the colon at ", colonPos);
       return {};
     }
   }
 
+  Ref numberLit;
+  if (isFloat)
+  {
+    FloatLit floatLit{};
+    floatLit.value = strtod(floatText.c_str(), nullptr);
+    floatLit.isNeg = isNeg;
+    floatLit.type = type;
+    numberLit = tree.add(pos, floatLit);
+  }
+  else
+  {
+    IntLit intLit{};
+    if (!toUint64(intPart, intLit.value))
+    {
+      errorln("The integer literal at ", pos, " does not fit in 64 bits");
+      return {};
+    }
+    intLit.isNeg = isNeg;
+    intLit.type = type;
+    numberLit = tree.add(pos, intLit);
+  }
+
   tokens = remainder;
   return numberLit;
 }
 
-Shared<Node> parseLit(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseLit(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  return parseNumberLit(tokens, nspace);
+  return parseNumberLit(tokens, nspace, tree);
 }
 
-Shared<FuncCall> parseFuncCall(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseFuncCall(Tokens& tokens, Ref nspace, Tree& tree)
 {
   (void) nspace;
   auto remainder = tokens;
 
-  if (remainder.front().type != Token::Type::identifier) { return {}; }
-
-  auto fnCall = std::make_shared<FuncCall>(remainder.front().pos);
-  fnCall->name = remainder.front().value;
-  remainder.pop();
-
-  if (remainder[0].type != Token::Type::left_paren &&
-      remainder[1].type != Token::Type::right_paren)
+  if (remainder.type(0) != Token::Type::identifier ||
+      remainder.type(1) != Token::Type::left_paren)
   {
     // Not a function call; probably an lvalue.
     return {};
   }
   remainder.pop(2);
 
+  // TODO: arguments
+  if (remainder.type() != Token::Type::right_paren)
+  {
+    errorln("Expected a ')' to close the function call at ", tokens.pos());
+    return {};
+  }
+  remainder.pop();
+
+  FuncCall fnCall{};
+  fnCall.name = tokens.symbol();
+  auto ref = tree.add(tokens.pos(), fnCall);
+
   tokens = remainder;
-  return fnCall;
+  return ref;
 }
 
-Shared<Node> parseRvalue(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseRvalue(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  return parseFuncCall(tokens, nspace);
+  return parseFuncCall(tokens, nspace, tree);
 }
 
-Shared<Lvalue> parseLvalue(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseLvalue(Tokens& tokens, Ref nspace, Tree& tree)
 {
   (void) nspace;
 
-  if (tokens.front().type != Token::Type::identifier) { return {}; }
+  if (tokens.type() != Token::Type::identifier) { return {}; }
 
-  auto var = std::make_shared<Lvalue>(tokens.front().pos, tokens.front().value);
+  Lvalue lvalue{};
+  lvalue.name = tokens.symbol();
+  auto var = tree.add(tokens.pos(), lvalue);
   tokens.pop();
 
   return var;
 }
 
-Shared<Node> parseExpr(Tokens& tokens, Shared<Namespace> nspace);
-
-Shared<Node> parseParenExpr(Tokens& tokens, Shared<Namespace> nspace)
+// Parenthesized expressions are handled by parseExpr itself
+inline Ref parsePrimaryExpr(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  if (tokens.front().type != Token::Type::left_paren) { return {}; }
-
-  auto remainder = tokens;
-  remainder.pop(); // pop the left parenthesis
-  auto expr = parseExpr(remainder, nspace);
-
-  if (remainder.front().type != Token::Type::right_paren)
+  // The first two tokens decide which expression this can be
+  switch (tokens.type())
   {
-    errorln("Expected a ')' to match the '(' at ",
-      tokens.front().pos);
-    return {};
+    case Token::Type::minus :
+    case Token::Type::number :
+    {
+      return parseLit(tokens, nspace, tree);
+    }
+    case Token::Type::identifier :
+    {
+      if (tokens.type(1) == Token::Type::left_paren)
+      {
+        return parseRvalue(tokens, nspace, tree);
+      }
+      return parseLvalue(tokens, nspace, tree);
+    }
+    default :
+    {
+      return {};
+    }
   }
-  remainder.pop(); // pop the right parenthesis
-
-  tokens = remainder;
-  return expr;
 }
 
-Shared<Node> parsePrimaryExpr(Tokens& tokens, Shared<Namespace> nspace)
+/// @return how tightly the binary operator @p type binds, or 0 if @p type is
+///   not a binary operator
+inline ubyte_t precedence(Token::Type type)
 {
+  switch (type)
   {
-    auto expr = parseParenExpr(tokens, nspace);
-    if (expr) { return expr; }
-  }
-
-  {
-    auto expr = parseLit(tokens, nspace);
-    if (expr) { return expr; }
-  }
-
-  {
-    auto expr = parseRvalue(tokens, nspace);
-    if (expr) { return expr; }
-  }
-
-  {
-    auto expr = parseLvalue(tokens, nspace);
-    if (expr) { return expr; }
+    case Token::Type::asterisk :
+    case Token::Type::fwd_slash :
+    {
+      return 2;
+    }
+    case Token::Type::plus :
+    case Token::Type::minus :
+    {
+      return 1;
+    }
+    default :
+    {
+      return 0;
+    }
   }
-
-  return {};
 }
 
-Shared<Node> parseMultExpr(Tokens& tokens, Shared<Namespace> nspace)
+/// @brief An operator or '(' that parseExpr has read but not yet applied
+struct PendingOp
 {
-  auto remainder = tokens;
-
-  auto lhs = parsePrimaryExpr(remainder, nspace);
-  if (!lhs) { return {}; }
-
-  const auto type = remainder.front().type;
-  if (type != Token::Type::asterisk &&
-      type != Token::Type::fwd_slash)
-  {
-    tokens = remainder;
-    return lhs;
-  }
-
-  // At this point it's safe to assume that this is an add operation
-  auto multExpr = std::make_shared<BinExpr>(remainder.front().pos, lhs, type);
-  remainder.pop(); // Remove the add operator
-
-  multExpr->rhs = parseExpr(remainder, nspace);
-  if (!multExpr->rhs)
-  {
-    errorln("Expected an expression following the operator at ",
-      multExpr->pos());
-    return {};
-  }
-
-  tokens = remainder;
-  return multExpr;
+  /// @brief Token::Type::left_paren for a parenthesis
+  Token::Type type;
+  Pos pos;
+};
+
+/// @brief Pops an operator and its two operands and pushes the BinExpr that
+///   applies it
+inline void reduce(Darray<Ref, 8>& operands, Darray<PendingOp, 8>& ops, Tree& tree)
+{
+  const auto op = ops.back();
+  ops.popBack();
+  const auto rhs = operands.back();
+  operands.popBack();
+  const auto lhs = operands.back();
+  operands.popBack();
+  operands.pushBack(tree.add(op.pos, BinExpr{lhs, rhs, op.type}));
 }
 
-Shared<Node> parseAddExpr(Tokens& tokens, Shared<Namespace> nspace)
+// <primary> (<binary operator> <primary>)*, where a primary may also be a
+// parenthesized expression
+//
+// This is operator precedence parsing with explicit operand and operator
+// stacks instead of recursion, so neither long chains of operators nor deep
+// nesting of parentheses use any more native stack. Operators of equal
+// precedence group to the left.
+inline Ref parseExpr(Tokens& tokens, Ref nspace, Tree& tree)
 {
   auto remainder = tokens;
+  Darray<Ref, 8> operands;
+  Darray<PendingOp, 8> ops;
+  size_t openParens = 0;
 
-  auto lhs = parseMultExpr(remainder, nspace);
-  if (!lhs) { return {}; }
-
-  const auto type = remainder.front().type;
-  if (type != Token::Type::plus &&
-      type != Token::Type::minus)
+  bool expectOperand = true;
+  while (true)
   {
-    tokens = remainder;
-    return lhs;
-  }
+    if (expectOperand)
+    {
+      if (remainder.type() == Token::Type::left_paren)
+      {
+        ops.pushBack({Token::Type::left_paren, remainder.pos()});
+        ++openParens;
+        remainder.pop();
+        continue;
+      }
+
+      auto operand = parsePrimaryExpr(remainder, nspace, tree);
+      if (!operand)
+      {
+        // Nothing has been read, so this is just not an expression
+        if (ops.isEmpty()) { return {}; }
+
+        const auto& op = ops.back();
+        if (op.type == Token::Type::left_paren)
+        {
+          errorln("Expected an expression following the '(' at ", op.pos);
+        }
+        else
+        {
+          errorln("Expected an expression following the operator at ", op.pos);
+        }
+        return {};
+      }
+      operands.pushBack(operand);
+      expectOperand = false;
+      continue;
+    }
 
-  // At this point it's safe to assume that this is an add operation
-  auto addExpr = std::make_shared<BinExpr>(remainder.front().pos, lhs, type);
-  remainder.pop(); // Remove the add operator
+    const auto type = remainder.type();
+    const auto prec = precedence(type);
+    if (prec > 0)
+    {
+      // Apply the pending operators that bind at least as tightly. Taking
+      // equal precedence here is what makes operators left-associative.
+      while (!ops.isEmpty() && precedence(ops.back().type) >= prec)
+      {
+        reduce(operands, ops, tree);
+      }
+      ops.pushBack({type, remainder.pos()});
+      remainder.pop();
+      expectOperand = true;
+    }
+    else if (type == Token::Type::right_paren && openParens > 0)
+    {
+      while (ops.back().type != Token::Type::left_paren)
+      {
+        reduce(operands, ops, tree);
+      }
+      ops.popBack();
+      --openParens;
+      remainder.pop();
+    }
+    else
+    {
+      // Anything else ends the expression
+      break;
+    }
+  }
 
-  addExpr->rhs = parseMultExpr(remainder, nspace);
-  if (!addExpr->rhs)
+  if (openParens > 0)
   {
-    errorln("Expected an expression following the operator at ",
-      addExpr->pos());
+    // Report the innermost unmatched parenthesis
+    while (ops.back().type != Token::Type::left_paren) { ops.popBack(); }
+    errorln("Expected a ')' to match the '(' at ", ops.back().pos);
     return {};
   }
 
-  tokens = remainder;
-  return addExpr;
-}
-
-Shared<Node> parseExpr(Tokens& tokens, Shared<Namespace> nspace)
-{
+  while (!ops.isEmpty())
   {
-    auto addExpr = parseAddExpr(tokens, nspace);
-    if (addExpr) { return addExpr; }
+    reduce(operands, ops, tree);
   }
 
-  return {};
+  tokens = remainder;
+  return operands.back();
 }
 
-Shared<Node> parseRetStmnt(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseRetStmnt(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  if (tokens.front().type != Token::Type::keyword_ret)
+  if (tokens.type() != Token::Type::keyword_ret)
   {
     return {};
   }
 
   // At this point, it's safe to assume a return statement is here.
-  auto retStmnt = std::make_shared<RetStmnt>(tokens.front().pos);
+  const Pos pos = tokens.pos();
   tokens.pop();
 
   // Optionally parse an expression
-  retStmnt->expr = parseExpr(tokens, nspace);
+  auto expr = parseExpr(tokens, nspace, tree);
 
-  if (tokens.front().type != Token::Type::semicolon)
+  if (tokens.type() != Token::Type::semicolon)
   {
-    errorln("Expected a semicolon to close out a return statement at ",
-      retStmnt->pos());
+    errorln("Expected a semicolon to close out a return statement at ", pos);
     return {};
   }
   tokens.pop();
 
-  return retStmnt;
+  return tree.add(pos, RetStmnt{expr});
 }
 
-Shared<VarDecl> parseVarDecl(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseVarDecl(Tokens& tokens, Ref nspace, Tree& tree)
 {
   auto remainder = tokens;
 
-  if (remainder.front().type != Token::Type::identifier)
+  if (remainder.type() != Token::Type::identifier)
   {
     return {};
   }
-  auto name = remainder.front();
   remainder.pop();
 
-  if (remainder.front().type != Token::Type::colon)
+  if (remainder.type() != Token::Type::colon)
   {
     return {};
   }
 
   // At this point, it's safe to assume that this is a variable declaration.
-  auto varDecl = std::make_shared<VarDecl>(name.pos, name.value);
   remainder.pop(); // pop the colon token
 
-  varDecl->type = parseType(remainder, nspace);
+  auto type = parseType(remainder, nspace, tree);
+  auto varDecl = tree.add(tokens.pos(), VarDecl{tokens.symbol(), type});
 
   tokens = remainder;
   return varDecl;
 }
 
-Shared<Initializer> parseInitializer(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseInitializer(Tokens& tokens, Ref nspace, Tree& tree)
 {
   auto remainder = tokens;
 
-  if (remainder.front().type != Token::Type::left_brace) { return {}; }
+  if (remainder.type() != Token::Type::left_brace) { return {}; }
 
-  auto initializer = std::make_shared<Initializer>(remainder.front().pos);
+  const Pos pos = remainder.pos();
   remainder.pop();
 
+  Tree::ListBuilder exprs{tree};
   bool expectComma = false;
-  while (remainder.front().type != Token::Type::right_brace)
+  while (remainder.type() != Token::Type::right_brace)
   {
     if (expectComma)
     {
       errorln("Failed to parse an initializer list. Expected a comma at ",
-        remainder.front().pos);
+        remainder.pos());
       return {};
     }
 
-    auto expr = parseExpr(remainder, nspace);
+    auto expr = parseExpr(remainder, nspace, tree);
     if (!expr)
     {
       errorln("Expected an expression as part of the initializer list at ",
-        initializer->pos());
+        pos);
       return {};
     }
-    initializer->addExpr(expr);
+    exprs.add(expr);
     expectComma = true;
   }
   remainder.pop(); // pop the right curly brace
 
   tokens = remainder;
-  return initializer;
+  return tree.add(pos, Initializer{exprs.commit()});
 }
 
-Shared<VarDeclStmnt> parseVarDeclStmnt(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseVarDeclStmnt(Tokens& tokens, Ref nspace, Tree& tree)
 {
   auto remainder = tokens;
-  auto decl = parseVarDecl(remainder, nspace);
+  auto decl = parseVarDecl(remainder, nspace, tree);
   if (!decl) { return {}; }
 
   // At this point, it's safe to assume a variable declaration statement is here.
-  auto varDecl = std::make_shared<VarDeclStmnt>(decl->pos());
-  varDecl->decl = decl;
+  const Pos pos = tree.pos(decl);
 
   // Optional initializer
-  varDecl->initializer = parseInitializer(remainder, nspace);
+  auto initializer = parseInitializer(remainder, nspace, tree);
 
-  if (remainder.front().type != Token::Type::semicolon)
+  if (remainder.type() != Token::Type::semicolon)
   {
     errorln("Expected a semicolon to terminate the variable declaration at ",
-      varDecl->pos());
+      pos);
   }
   remainder.pop(); // pop the semicolon
-  
+
   tokens = remainder;
-  return varDecl;
+  return tree.add(pos, VarDeclStmnt{decl, initializer});
 }
 
-Shared<Node> parseExprStmnt(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseExprStmnt(Tokens& tokens, Ref nspace, Tree& tree)
 {
   auto remainder = tokens;
 
-  auto expr = parseExpr(remainder, nspace);
+  auto expr = parseExpr(remainder, nspace, tree);
   if (!expr) { return {}; }
 
-  if (remainder.front().type != Token::Type::semicolon)
+  if (remainder.type() != Token::Type::semicolon)
   {
     return {};
   }
   remainder.pop(); // pop the semicolon token
 
   tokens = remainder;
-  return std::make_shared<ExprStmnt>(expr);
+  return tree.add(tree.pos(expr), ExprStmnt{expr});
 }
 
-Shared<Node> parseStmnt(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseStmnt(Tokens& tokens, Ref nspace, Tree& tree)
 {
+  // The first two tokens decide which statement this can be
+  switch (tokens.type())
   {
-    auto retStmnt = parseRetStmnt(tokens, nspace);
-    if (retStmnt) { return retStmnt; }
-  }
-
-  {
-    auto varDecl = parseVarDeclStmnt(tokens, nspace);
-    if (varDecl) { return varDecl; }
-  }
-
-  {
-    auto exprStmnt = parseExprStmnt(tokens, nspace);
-    if (exprStmnt) { return exprStmnt; }
+    case Token::Type::keyword_ret :
+    {
+      return parseRetStmnt(tokens, nspace, tree);
+    }
+    case Token::Type::identifier :
+    {
+      if (tokens.type(1) == Token::Type::colon)
+      {
+        return parseVarDeclStmnt(tokens, nspace, tree);
+      }
+      return parseExprStmnt(tokens, nspace, tree);
+    }
+    default :
+    {
+      return parseExprStmnt(tokens, nspace, tree);
+    }
   }
-
-  return {};
 }
 
 // { <statement>* }
-Shared<Block> parseBlock(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseBlock(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  if (tokens.front().type != Token::Type::left_brace)
+  if (tokens.type() != Token::Type::left_brace)
   {
     return {};
   }
 
   // At this point, it's safe to assume a block is here
-  auto block = std::make_shared<Block>(tokens.front().pos);
+  const Pos pos = tokens.pos();
   tokens.pop();
 
   // TODO: While not }, parse statement
+  Tree::ListBuilder stmnts{tree};
   while (true)
   {
-    if (tokens.front().type == Token::Type::right_brace)
+    if (tokens.type() == Token::Type::right_brace)
     {
       tokens.pop();
-      return block;
+      return tree.add(pos, Block{stmnts.commit()});
     }
 
-    auto stmnt = parseStmnt(tokens, nspace);
+    auto stmnt = parseStmnt(tokens, nspace, tree);
     if (stmnt)
     {
-      block->addStmnt(stmnt);
+      stmnts.add(stmnt);
     }
     else
     {
-      errorln("Expected a right curly brace or a statement at ",
-        block->pos());
+      errorln("Expected a right curly brace or a statement at ", pos);
       return {};
     }
   }
@@ -518,58 +629,135 @@ Shared<Block> parseBlock(Tokens& tokens, Shared<Namespace> nspace)
   return {};
 }
 
-// <fn> <identifier>? (':' <ins> ('=' '>' <outs>)? )? <block>
-Shared<FuncDefn> parseFuncDefn(Tokens& tokens, Shared<Namespace> nspace)
+/// @pre the front of @p tokens is 'fn'
+/// @brief Parses everything of a function definition up to its body into
+///   @p funcDefn
+/// @return false after reporting an error
+inline bool parseFuncSignature(Tokens& tokens, Ref nspace, Tree& tree, Pos pos,
+  FuncDefn& funcDefn)
 {
-  if (tokens.front().type != Token::Type::keyword_fn)
-  {
-    return {};
-  }
-
-  // At this point, it's safe to assume a function definition is here
-  auto funcDefn = std::make_shared<FuncDefn>(tokens.front().pos, nspace);
+  funcDefn.parent = nspace;
   tokens.pop();
 
   // Look for the optional name of the function
-  if (tokens.front().type == Token::Type::identifier)
+  if (tokens.type() == Token::Type::identifier)
   {
-    std::string name
-    {
-      &tokens.front().value.front(),
-      tokens.front().value.size()
-    };
-    funcDefn->name = name;
+    funcDefn.name = tokens.symbol();
     tokens.pop();
   }
 
   // Look for the (optional) function type
-  if (tokens.front().type == Token::Type::colon)
+  if (tokens.type() == Token::Type::colon)
   {
-    auto colonPos = tokens.front().pos;
+    auto colonPos = tokens.pos();
     tokens.pop();
-    funcDefn->funcType = parseFuncType(tokens, nspace);
-    if (!funcDefn->funcType)
+    funcDefn.funcType = parseFuncType(tokens, nspace, tree);
+    if (!funcDefn.funcType)
     {
       errorln("Expected a function type following the colon at ",
         colonPos);
-      return {};
+      return false;
     }
   }
   else
   {
     // Use a () => () function type by default
-    funcDefn->funcType = std::make_shared<FuncType>(funcDefn->pos());
+    funcDefn.funcType = tree.add(pos, FuncType{});
+  }
+
+  return true;
+}
+
+/// @return the span of @p tokens from its front up to, but not including,
+///   the front of @p rest
+inline TokenSpan spanOf(Tokens tokens, Tokens rest)
+{
+  const auto first = tokens.stream()->index(tokens.front());
+  const auto end = rest.isEmpty() ?
+    tokens.stream()->count() : tokens.stream()->index(rest.front());
+  return {uint32_t(first), uint32_t(end - first)};
+}
+
+// <fn> <identifier>? (':' <ins> ('=' '>' <outs>)? )? <block>
+inline Ref parseFuncDefn(Tokens& tokens, Ref nspace, Tree& tree)
+{
+  if (tokens.type() != Token::Type::keyword_fn)
+  {
+    return {};
+  }
+
+  // At this point, it's safe to assume a function definition is here
+  IRON_TRACE(parse, "func_defn", tokens.front().offset);
+  const Pos pos = tokens.pos();
+  FuncDefn funcDefn{};
+  if (!parseFuncSignature(tokens, nspace, tree, pos, funcDefn)) { return {}; }
+
+  const auto body = tokens;
+  funcDefn.block = parseBlock(tokens, nspace, tree);
+  if (!funcDefn.block)
+  {
+    errorln("Expected a function block following the function signature at ",
+      pos);
+    return {};
   }
+  funcDefn.body = spanOf(body, tokens);
 
-  funcDefn->block = parseBlock(tokens, nspace);
-  if (!funcDefn->block)
+  return tree.add(pos, funcDefn);
+}
+
+/// @brief Parses the signature of a function definition and only finds the
+///   extent of its body, by matching braces. The body is left for
+///   @ref parseBody.
+inline Ref parseFuncDecl(Tokens& tokens, Ref nspace, Tree& tree)
+{
+  if (tokens.type() != Token::Type::keyword_fn)
+  {
+    return {};
+  }
+
+  IRON_TRACE(parse, "func_decl", tokens.front().offset);
+  const Pos pos = tokens.pos();
+  FuncDefn funcDefn{};
+  if (!parseFuncSignature(tokens, nspace, tree, pos, funcDefn)) { return {}; }
+
+  if (tokens.type() != Token::Type::left_brace)
   {
     errorln("Expected a function block following the function signature at ",
-      funcDefn->pos());
+      pos);
     return {};
   }
 
-  return funcDefn;
+  const auto body = tokens;
+  size_t depth = 0;
+  do
+  {
+    switch (tokens.type())
+    {
+      case Token::Type::left_brace :
+      {
+        ++depth;
+        break;
+      }
+      case Token::Type::right_brace :
+      {
+        --depth;
+        break;
+      }
+      case Token::Type::bad :
+      {
+        errorln("Expected a '}' to close the function block at ", body.pos());
+        return {};
+      }
+      default :
+      {
+        break;
+      }
+    }
+    tokens.pop();
+  } while (depth > 0);
+  funcDefn.body = spanOf(body, tokens);
+
+  return tree.add(pos, funcDefn);
 }
 
 // Function Declaration or
@@ -577,33 +765,252 @@ Shared<FuncDefn> parseFuncDefn(Tokens& tokens, Shared<Namespace> nspace)
 // Class Declaration or
 // Alias Declaration or
 // Namespace Declaration
-Shared<Node> parseDecl(Tokens& tokens, Shared<Namespace> nspace)
+inline Ref parseDecl(Tokens& tokens, Ref nspace, Tree& tree)
 {
-  return parseFuncDefn(tokens, nspace);
+  switch (tokens.type())
+  {
+    case Token::Type::keyword_fn :
+    {
+      return parseFuncDefn(tokens, nspace, tree);
+    }
+    default :
+    {
+      return {};
+    }
+  }
 }
 
-Shared<Node> parse(Tokens tokens)
+/// @brief Parses declarations until @p tokens runs out, adding each to
+///   @p decls
+/// @tparam TparseDecl parseDecl, or a function of the same shape
+/// @return false after reporting the first one that does not parse
+template<Ref (*TparseDecl)(Tokens&, Ref, Tree&) = parseDecl>
+bool parseDecls(Tokens tokens, Ref nspace, Tree& tree, Darray<Ref>& decls)
 {
-  auto global = std::make_shared<Namespace>(Pos{0,0});
-  global->name = "_";
-
   while (!tokens.isEmpty())
   {
-    auto decl = parseDecl(tokens, global);
+    // A declaration that fails may have read up to the end of the tokens,
+    // so report where it started
+    auto remainder = tokens;
+    auto decl = TparseDecl(remainder, nspace, tree);
     if (!decl)
     {
-      errorln("Expected a declaration at ", tokens.front().pos);
-      return {};
+      errorln("Expected a declaration at ", tokens.pos());
+      return false;
     }
+    tokens = remainder;
 
-    // Add the decl to the namespace
-    global->decls.pushBack(decl);
+    IRON_TRACE(parse, "decl", tree.pos(decl).row, tree.pos(decl).col);
+    decls.pushBack(decl);
   }
+  return true;
+}
+
+/// @brief Below this many declarations per task, the cost of a task's tree
+///   and of merging it outweighs parsing it on another thread
+static const size_t MIN_DECLS_PER_TASK = 64;
+static const size_t TASKS_PER_THREAD = 8;
+
+/// @brief Finds the index of every 'fn' outside of any braces. Each one
+///   starts a top-level declaration, which parses independently of the rest.
+/// @return false if the braces do not balance, in which case declarations
+///   cannot be told apart without parsing
+inline bool findDecls(Tokens tokens, Darray<size_t>& starts)
+{
+  size_t depth = 0;
+  for (size_t i=0; i<tokens.size(); ++i)
+  {
+    switch (tokens.at(i).type)
+    {
+      case Token::Type::keyword_fn :
+      {
+        if (depth == 0) { starts.pushBack(i); }
+        break;
+      }
+      case Token::Type::left_brace :
+      {
+        ++depth;
+        break;
+      }
+      case Token::Type::right_brace :
+      {
+        if (depth == 0) { return false; }
+        --depth;
+        break;
+      }
+      default :
+      {
+        break;
+      }
+    }
+  }
+  return depth == 0;
+}
+
+/// @brief Parses the declarations of @p tokens in batches on up to
+///   @p threadCount threads, each batch into a tree of its own, and then
+///   appends the trees to @p tree in source order. The result is the same
+///   tree that parsing serially builds.
+/// @return false, with @p tree untouched and nothing reported, if the source
+///   is too small to split or does not parse. Parsing serially then reports
+///   the same errors it always would.
+inline bool parseParallel(Tokens tokens, Ref nspace, Tree& tree, Darray<Ref>& decls,
+  size_t threadCount)
+{
+  Darray<size_t> starts;
+  if (!findDecls(tokens, starts)) { return false; }
+
+  // A few tasks per thread are enough to even out the load; more only add
+  // trees to grow and merge
+  const size_t taskCount =
+    std::min(starts.count() / MIN_DECLS_PER_TASK, threadCount * TASKS_PER_THREAD);
+  if (taskCount < 2) { return false; }
+
+  // Looking up a position builds the line table on first use; do it now,
+  // before several threads look up positions at once
+  tokens.stream()->indexLines();
+
+  std::vector<Tree> trees(taskCount);
+  std::vector<Darray<Ref>> taskDecls(taskCount);
+  std::atomic<bool> failed{false};
+  runTasks(taskCount, threadCount, [&](size_t task, size_t)
+  {
+    if (failed.load(std::memory_order_relaxed)) { return; }
+
+    // Anything before the first declaration belongs to the first task, so
+    // that it is reported just as it would be serially
+    const size_t first = (task == 0) ? 0 : starts.at(starts.count() * task / taskCount);
+    const size_t last = (task + 1 == taskCount) ?
+      tokens.size() : starts.at(starts.count() * (task + 1) / taskCount);
+    Tokens batch{{&tokens.at(first), &tokens.at(first) + (last - first) - 1},
+      tokens.stream()};
+
+    // The errors are dropped; the serial parse reports them in order
+    ErrorBuffer errors;
+    if (!parseDecls(batch, Ref{}, trees[task], taskDecls[task]))
+    {
+      failed.store(true, std::memory_order_relaxed);
+    }
+  });
+  if (failed.load()) { return false; }
+
+  auto extent = tree.extent();
+  for (size_t task=0; task<taskCount; ++task)
+  {
+    const auto add = trees[task].extent();
+    for (size_t i=0; i<KIND_COUNT; ++i) { extent.nodes[i] += add.nodes[i]; }
+    extent.lists += add.lists;
+  }
+  tree.reserve(extent);
+
+  for (size_t task=0; task<taskCount; ++task)
+  {
+    const auto by = tree.append(trees[task]);
+    trees[task] = Tree{};
+    for (size_t i=0; i<taskDecls[task].count(); ++i)
+    {
+      const auto decl = by(taskDecls[task].at(i));
+      // Every declaration is a function definition so far. Batches are
+      // parsed without a namespace, so they are placed in it here.
+      tree.get<FuncDefn>(decl).parent = nspace;
+      decls.pushBack(decl);
+    }
+  }
+  return true;
+}
+
+/// @brief Adds the global namespace to @p tree
+inline Ref addGlobal(Tree& tree)
+{
+  Namespace nspace{};
+  nspace.name = symbols().intern("_"_ascii);
+  return tree.add(Pos{0,0}, nspace);
+}
+
+/// @brief Adds @p decls to the global namespace and makes it the root
+inline Ref setGlobal(Ref global, const Darray<Ref>& decls, Tree& tree)
+{
+  Tree::ListBuilder list{tree};
+  for (size_t i=0; i<decls.count(); ++i) { list.add(decls.at(i)); }
+  tree.get<Namespace>(global).decls = list.commit();
+  tree.setRoot(global);
 
   return global;
 }
 
+/// @brief Parses @p tokens into @p tree, whose root becomes the global
+///   namespace
+/// @param threadCount the number of threads to parse with. Only sources with
+///   many top-level declarations are split.
+/// @return the root, or a null Ref on failure
+inline Ref parse(Tokens tokens, Tree& tree, size_t threadCount = 1)
+{
+  auto global = addGlobal(tree);
+
+  Darray<Ref> decls;
+  if (threadCount <= 1 || !parseParallel(tokens, global, tree, decls, threadCount))
+  {
+    if (!parseDecls(tokens, global, tree, decls)) { return {}; }
+  }
+
+  return setGlobal(global, decls, tree);
+}
+
+// Only function definitions can be declared so far
+inline Ref parseLazyDecl(Tokens& tokens, Ref nspace, Tree& tree)
+{
+  switch (tokens.type())
+  {
+    case Token::Type::keyword_fn :
+    {
+      return parseFuncDecl(tokens, nspace, tree);
+    }
+    default :
+    {
+      return {};
+    }
+  }
+}
+
+/// @brief Parses @p tokens like @ref parse, except that the body of every
+///   function is skipped. Each one is parsed by @ref parseBody when it is
+///   needed, so errors in a body that is never needed are never reported.
+/// @return the root, or a null Ref on failure
+inline Ref parseSignatures(Tokens tokens, Tree& tree)
+{
+  auto global = addGlobal(tree);
+
+  Darray<Ref> decls;
+  if (!parseDecls<parseLazyDecl>(tokens, global, tree, decls)) { return {}; }
+
+  return setGlobal(global, decls, tree);
+}
+
+/// @brief Parses the body of the function @p funcDefn, which
+///   @ref parseSignatures parsed from @p tokens. Does nothing if the body is
+///   already parsed.
+/// @return false after reporting an error
+inline bool parseBody(const TokenStream& tokens, Ref funcDefn, Tree& tree)
+{
+  const auto defn = tree.get<FuncDefn>(funcDefn);
+  if (defn.isParsed()) { return true; }
+
+  IRON_TRACE(parse, "body", defn.body.first, defn.body.count);
+  auto body = tokens.range(defn.body.first, defn.body.count);
+  auto block = parseBlock(body, defn.parent, tree);
+  if (!block)
+  {
+    errorln("Expected a function block following the function signature at ",
+      tree.pos(funcDefn));
+    return false;
+  }
+  // The span was found by matching braces, so the block has to end with it
+  assert(body.isEmpty());
+
+  tree.get<FuncDefn>(funcDefn).block = block;
+  return true;
+}
+
 } // namespace ast
 
 } // namespace iron
-
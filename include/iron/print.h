@@ -2,7 +2,9 @@
 
 // standard includes
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 
 // iron includes
@@ -24,7 +26,7 @@ inline int print(FILE* file, Ascii str)
 
 inline int print(FILE* file, const char* c_str)
 {
-  if (0 < fprintf(file, "%s", c_str))
+  if (fprintf(file, "%s", c_str) < 0)
   {
     return errno;
   }
@@ -33,7 +35,7 @@ inline int print(FILE* file, const char* c_str)
 
 inline int print(FILE* file, std::string str)
 {
-  if (0 < fprintf(file, "%s", str.c_str()))
+  if (fprintf(file, "%s", str.c_str()) < 0)
   {
     return errno;
   }
@@ -42,7 +44,7 @@ inline int print(FILE* file, std::string str)
 
 inline int print(FILE* file, char c)
 {
-  if (0 < fprintf(file, "%c", c))
+  if (fprintf(file, "%c", c) < 0)
   {
     return errno;
   }
@@ -51,7 +53,7 @@ inline int print(FILE* file, char c)
 
 inline int print(FILE* file, size_t number)
 {
-  if (0 < fprintf(file, "%lu", number))
+  if (fprintf(file, "%lu", number) < 0)
   {
     return errno;
   }
@@ -75,17 +77,103 @@ inline int println(FILE* file, Ttypes&&... args)
   return print(file, std::forward<Ttypes>(args)..., "\n");
 }
 
-extern bool infoOn;
-extern bool errorOn;
+/// @brief Whether @ref infoln writes anything on this thread
+extern __thread bool infoOn;
+/// @brief Whether @ref errorln writes anything on this thread
+extern __thread bool errorOn;
+/// @brief Where @ref errorln writes on this thread, or null for stderr
+extern __thread FILE* errorFile;
+
+/// @brief Where and whether this thread reports errors and information.
+///
+/// These are per thread, so compilations on different threads can report
+/// to different places. Work handed to other threads takes the settings of
+/// the thread that hands it out (see @ref runTasks).
+struct Diagnostics
+{
+  bool info;
+  bool errors;
+  FILE* file;
+
+  /// @return the settings of the calling thread
+  static Diagnostics current() { return {infoOn, errorOn, errorFile}; }
+
+  /// @brief Makes these the settings of the calling thread
+  void install() const
+  {
+    infoOn = info;
+    errorOn = errors;
+    errorFile = file;
+  }
+};
 
 template<typename... Ttypes>
 inline int errorln(Ttypes&&... args)
 {
   return errorOn ?
-    println(stderr, "Error: ", std::forward<Ttypes>(args)...) :
+    println((errorFile != nullptr) ? errorFile : stderr, "Error: ",
+      std::forward<Ttypes>(args)...) :
     0;
 }
 
+/// @brief Collects the errors this thread reports while it is alive, so that
+///   work done on several threads can report them in a deterministic order
+class ErrorBuffer
+{
+private :
+  FILE* _previous;
+  FILE* _file;
+  char* _data;
+  size_t _size;
+  /// @brief How much of @ref _data has already been written out
+  size_t _flushed;
+
+public :
+  ErrorBuffer() :
+      _previous(errorFile), _file(nullptr), _data(nullptr), _size(0), _flushed(0)
+  {
+    _file = open_memstream(&_data, &_size);
+    // If there is no memory for a buffer, errors just go where they did
+    if (_file != nullptr) { errorFile = _file; }
+  }
+  ErrorBuffer(const ErrorBuffer&) = delete;
+  ~ErrorBuffer()
+  {
+    if (_file != nullptr)
+    {
+      errorFile = _previous;
+      fclose(_file);
+    }
+    free(_data);
+  }
+
+  bool isEmpty()
+  {
+    if (_file != nullptr) { fflush(_file); }
+    return _size == _flushed;
+  }
+
+  /// @brief Writes the errors collected since the last flush to @p file
+  void flush(FILE* file)
+  {
+    if (_file == nullptr) { return; }
+    fflush(_file);
+    (void) fwrite(_data + _flushed, 1, _size - _flushed, file);
+    _flushed = _size;
+  }
+
+  /// @brief Takes the errors collected since the last flush, so that another
+  ///   thread can write them out once this buffer is gone
+  std::string take()
+  {
+    if (_file == nullptr) { return {}; }
+    fflush(_file);
+    std::string errors{_data + _flushed, _size - _flushed};
+    _flushed = _size;
+    return errors;
+  }
+};
+
 template<typename... Ttypes>
 inline int infoln(Ttypes&&... args)
 {
@@ -94,5 +182,64 @@ inline int infoln(Ttypes&&... args)
     0;
 }
 
+/// @brief Low-overhead event tracing
+///
+/// Events are recorded with @ref IRON_TRACE into a fixed-size ring buffer per
+/// thread. Only a pointer to the event's name and two integers are stored, so
+/// recording costs a few stores. The rings are written out as text when the
+/// process exits or crashes. Select categories at run time with @ref enable,
+/// e.g. from the TRACE environment variable: TRACE=lex,parse or TRACE=all.
+namespace trace
+{
+
+enum class Category : ubyte_t
+{
+  lex,
+  parse,
+  codegen
+};
+
+/// @brief A bit per Category. Set bits are recorded.
+extern uint32_t enabled;
+
+inline bool isOn(Category category)
+{
+  return (enabled & (1u << static_cast<uint32_t>(category))) != 0;
+}
+
+/// @brief Turns on the comma-separated list of category names in
+///   @p categories ("all" turns on every category), and arranges for the
+///   trace to be dumped to stderr at exit or on a fatal signal.
+/// @return false if a name was not recognized
+bool enable(const char* categories);
+
+/// @brief Appends an event to this thread's ring buffer
+/// @param what must be a string literal; only the pointer is kept
+void record(Category category, const char* what, uint64_t arg0 = 0,
+  uint64_t arg1 = 0);
+
+/// @brief Writes every thread's events, oldest first, to @p fd. This is
+///   async-signal-safe so it can run from a crash handler.
+void dump(int fd);
+
+} // namespace trace
+
 } // namespace iron
 
+/// @brief Records a trace event in @p category if that category is enabled.
+///   The arguments are only evaluated when it is. Builds with NDEBUG compile
+///   these out entirely unless IRON_TRACE_ON is also defined.
+/// @code IRON_TRACE(lex, "token", offset, size); @endcode
+#if defined(NDEBUG) && !defined(IRON_TRACE_ON)
+#define IRON_TRACE(category, ...) do {} while (false)
+#else
+#define IRON_TRACE(category, ...) \
+  do \
+  { \
+    if (::iron::trace::isOn(::iron::trace::Category::category)) \
+    { \
+      ::iron::trace::record(::iron::trace::Category::category, __VA_ARGS__); \
+    } \
+  } while (false)
+#endif
+
@@ -1,8 +1,20 @@
 #pragma once
 
+// standard includes
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
 // iron includes
 #include "iron/types.h"
 
+// SIMD includes
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace iron
 {
 
@@ -50,6 +62,11 @@ public :
   bool startsWith(const PtrRange<Ttype>& rhs) const
   {
     if (rhs.size() > size()) { return false; }
+    if (std::is_trivial<Ttype>::value && sizeof(Ttype) == 1)
+    {
+      // Bytes can be compared in bulk
+      return memcmp(_begin, rhs._begin, rhs.size()) == 0;
+    }
     for (size_t i=0; i<rhs.size(); ++i)
     {
       if (rhs.at(i) != at(i)) { return false; }
@@ -60,6 +77,168 @@ public :
 
 using Ascii = PtrRange<const char>;
 
+/// @brief Sets of ASCII bytes that the scanning functions below can skip
+enum class ByteClass
+{
+  /// @brief [0-9]
+  digit,
+  /// @brief ' ', '\t' and '\n'
+  whitespace,
+  /// @brief [0-9A-Za-z_]
+  word
+};
+
+namespace simd
+{
+
+inline bool isIn(ByteClass cls, byte_t c)
+{
+  switch (cls)
+  {
+    case ByteClass::digit :
+    {
+      return c >= '0' && c <= '9';
+    }
+    case ByteClass::whitespace :
+    {
+      return c == ' ' || c == '\t' || c == '\n';
+    }
+    case ByteClass::word :
+    {
+      return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z') || c == '_';
+    }
+  }
+  return false;
+}
+
+#if defined(__AVX2__)
+
+static const size_t WIDTH = 32;
+using Vec = __m256i;
+
+inline Vec load(const byte_t* p)
+{
+  return _mm256_loadu_si256(reinterpret_cast<const Vec*>(p));
+}
+inline Vec splat(byte_t c) { return _mm256_set1_epi8(c); }
+inline Vec equal(Vec v, byte_t c) { return _mm256_cmpeq_epi8(v, splat(c)); }
+inline Vec either(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+inline uint32_t mask(Vec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+/// Bytes >= 0x80 compare as negative, so they are never in an ASCII range.
+inline Vec inRange(Vec v, byte_t lo, byte_t hi)
+{
+  return _mm256_and_si256(_mm256_cmpgt_epi8(v, splat(lo - 1)),
+    _mm256_cmpgt_epi8(splat(hi + 1), v));
+}
+
+#elif defined(__SSE2__)
+
+static const size_t WIDTH = 16;
+using Vec = __m128i;
+
+inline Vec load(const byte_t* p)
+{
+  return _mm_loadu_si128(reinterpret_cast<const Vec*>(p));
+}
+inline Vec splat(byte_t c) { return _mm_set1_epi8(c); }
+inline Vec equal(Vec v, byte_t c) { return _mm_cmpeq_epi8(v, splat(c)); }
+inline Vec either(Vec a, Vec b) { return _mm_or_si128(a, b); }
+inline uint32_t mask(Vec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+/// Bytes >= 0x80 compare as negative, so they are never in an ASCII range.
+inline Vec inRange(Vec v, byte_t lo, byte_t hi)
+{
+  return _mm_and_si128(_mm_cmpgt_epi8(v, splat(lo - 1)),
+    _mm_cmplt_epi8(v, splat(hi + 1)));
+}
+
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+static const uint32_t FULL = (WIDTH == 32) ? 0xffffffffu : 0xffffu;
+
+/// @return a bit per byte of @p v, set when that byte is in @p cls
+inline uint32_t classMask(ByteClass cls, Vec v)
+{
+  switch (cls)
+  {
+    case ByteClass::digit :
+    {
+      return mask(inRange(v, '0', '9'));
+    }
+    case ByteClass::whitespace :
+    {
+      return mask(either(either(equal(v, ' '), equal(v, '\t')), equal(v, '\n')));
+    }
+    case ByteClass::word :
+    {
+      const auto alnum = either(inRange(v, '0', '9'),
+        either(inRange(v, 'a', 'z'), inRange(v, 'A', 'Z')));
+      return mask(either(alnum, equal(v, '_')));
+    }
+  }
+  return 0;
+}
+
+#endif
+
+} // namespace simd
+
+/// @return the index of the first byte of @p bytes that is not in @p cls, or
+///   the size of @p bytes if every byte is in @p cls
+inline size_t findFirstNotIn(PtrRange<const byte_t> bytes, ByteClass cls)
+{
+  if (bytes.isEmpty()) { return 0; }
+
+  const auto size = bytes.size();
+  const byte_t* data = &bytes.front();
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+  // Only whole vectors are loaded, so this never reads past the end of the
+  // range. That matters when the range ends at the end of an mmap'd file.
+  for (; i + simd::WIDTH <= size; i += simd::WIDTH)
+  {
+    const auto in = simd::classMask(cls, simd::load(data + i));
+    if (in != simd::FULL)
+    {
+      return i + __builtin_ctz(~in);
+    }
+  }
+#endif
+  while (i < size && simd::isIn(cls, data[i])) { ++i; }
+  return i;
+}
+
+/// @return the length of the run of spaces, tabs and newlines that starts
+///   @p bytes
+inline size_t skipWhitespace(PtrRange<const byte_t> bytes)
+{
+  return findFirstNotIn(bytes, ByteClass::whitespace);
+}
+
+/// @return the number of '\n' bytes in @p bytes
+inline size_t countNewlines(PtrRange<const byte_t> bytes)
+{
+  if (bytes.isEmpty()) { return 0; }
+
+  const auto size = bytes.size();
+  const byte_t* data = &bytes.front();
+  size_t count = 0;
+  size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; i + simd::WIDTH <= size; i += simd::WIDTH)
+  {
+    count += __builtin_popcount(simd::mask(simd::equal(simd::load(data + i), '\n')));
+  }
+#endif
+  for (; i < size; ++i)
+  {
+    if (data[i] == '\n') { ++count; }
+  }
+  return count;
+}
+
 } // namespace iron
 
 constexpr iron::Ascii operator "" _ascii(const char* str, size_t length)
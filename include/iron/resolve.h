@@ -0,0 +1,274 @@
+#pragma once
+
+// standard includes
+#include <unordered_map>
+
+// iron includes
+#include "iron/ast.h"
+#include "iron/darray.h"
+#include "iron/print.h"
+
+namespace iron
+{
+namespace ast
+{
+
+/// @brief Maps names to their declarations through nested scopes.
+///
+/// A name has a single entry in a hash map, for its innermost declaration in
+/// scope. A declaration that hides an outer one saves it, and leaving the
+/// scope puts it back, so looking a name up costs one hash of its interned id
+/// however deeply scopes are nested.
+class SymbolTable
+{
+private :
+  struct Entry
+  {
+    Ref decl;
+    /// @brief How many scopes were open when @ref decl was added
+    uint32_t depth;
+  };
+
+  /// @brief What a declaration in an open scope hid
+  struct Hidden
+  {
+    uint32_t id;
+    /// @brief A null decl means the name was not declared before
+    Entry entry;
+  };
+
+  std::unordered_map<uint32_t, Entry> _entries;
+  Darray<Hidden> _hidden;
+  /// @brief Where each open scope starts in @ref _hidden
+  Darray<size_t> _scopes;
+
+public :
+  void enter() { _scopes.pushBack(_hidden.count()); }
+
+  /// @brief Forgets what the innermost scope declared
+  void leave()
+  {
+    const auto mark = _scopes.back();
+    _scopes.popBack();
+    while (_hidden.count() > mark)
+    {
+      const auto hidden = _hidden.back();
+      _hidden.popBack();
+      if (hidden.entry.decl.isNull()) { _entries.erase(hidden.id); }
+      else { _entries[hidden.id] = hidden.entry; }
+    }
+  }
+
+  /// @brief Declares @p name as @p decl in the innermost scope
+  /// @return the declaration of @p name that is already in the innermost
+  ///   scope, in which case nothing is declared; otherwise a null Ref
+  Ref add(Symbol name, Ref decl)
+  {
+    const uint32_t depth = _scopes.count();
+    auto& entry = _entries[name.id()];
+    if (!entry.decl.isNull() && entry.depth == depth) { return entry.decl; }
+
+    _hidden.pushBack({name.id(), entry});
+    entry = {decl, depth};
+    return {};
+  }
+
+  /// @return the innermost declaration of @p name, or a null Ref
+  Ref find(Symbol name) const
+  {
+    const auto entry = _entries.find(name.id());
+    return (entry == _entries.end()) ? Ref{} : entry->second.decl;
+  }
+};
+
+/// @brief Binds every name that a @ref FuncCall or an @ref Lvalue uses to its
+///   declaration.
+///
+/// The functions of a namespace are declared before any body is resolved, so
+/// a body can call a function defined after it. A local variable is in scope
+/// from the end of its declaration to the end of its function.
+class Resolver
+{
+private :
+  Tree& _tree;
+  SymbolTable _symbols;
+
+  bool declare(Symbol name, Ref decl)
+  {
+    const auto previous = _symbols.add(name, decl);
+    if (!previous.isNull())
+    {
+      errorln("At ", _tree.pos(decl), " -- Redefinition of ", name,
+        ", which is first defined at ", _tree.pos(previous));
+      return false;
+    }
+    return true;
+  }
+
+  bool bind(Symbol name, Ref node, Ref& decl)
+  {
+    decl = _symbols.find(name);
+    if (decl.isNull())
+    {
+      errorln("At ", _tree.pos(node), " -- Could not find anything named ", name);
+      return false;
+    }
+    return true;
+  }
+
+  /// @brief Resolves the names in @p expr, however deeply it nests
+  bool resolveExpr(Ref expr)
+  {
+    Darray<Ref, 16> exprs;
+    exprs.pushBack(expr);
+    while (!exprs.isEmpty())
+    {
+      const auto node = exprs.back();
+      exprs.popBack();
+      switch (node.kind())
+      {
+        case Kind::binary_expr :
+        {
+          const auto& binaryExpr = _tree.get<BinExpr>(node);
+          exprs.pushBack(binaryExpr.rhs);
+          exprs.pushBack(binaryExpr.lhs);
+          break;
+        }
+        case Kind::func_call :
+        {
+          auto& funcCall = _tree.get<FuncCall>(node);
+          if (!bind(funcCall.name, node, funcCall.decl)) { return false; }
+          break;
+        }
+        case Kind::lvalue :
+        {
+          auto& lvalue = _tree.get<Lvalue>(node);
+          if (!bind(lvalue.name, node, lvalue.decl)) { return false; }
+          break;
+        }
+        default :
+        {
+          // Literals name nothing
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool resolveStmnt(Ref stmnt)
+  {
+    switch (stmnt.kind())
+    {
+      case Kind::expr_stmnt :
+      {
+        return resolveExpr(_tree.get<ExprStmnt>(stmnt).expr);
+      }
+      case Kind::ret_stmnt :
+      {
+        const auto& retStmnt = _tree.get<RetStmnt>(stmnt);
+        return retStmnt.isVoid() || resolveExpr(retStmnt.expr);
+      }
+      case Kind::var_decl_stmnt :
+      {
+        // The initializer is resolved first, so it cannot name the variable
+        const auto& varDeclStmnt = _tree.get<VarDeclStmnt>(stmnt);
+        const auto& varDecl = _tree.get<VarDecl>(varDeclStmnt.decl);
+        // TODO: Default construction
+        if (varDeclStmnt.initializer.isNull())
+        {
+          errorln("At ", _tree.pos(varDeclStmnt.decl), " -- ", varDecl.name,
+            " needs a value to initialize it with");
+          return false;
+        }
+        const auto& initializer = _tree.get<Initializer>(varDeclStmnt.initializer);
+        for (auto exprs = _tree.list(initializer.exprs); !exprs.isEmpty(); exprs.pop())
+        {
+          if (!resolveExpr(exprs.front())) { return false; }
+        }
+        return declare(varDecl.name, varDeclStmnt.decl);
+      }
+      default :
+      {
+        errorln("At ", _tree.pos(stmnt), " -- Internal Compiler Error: "
+          "cannot resolve a statement of kind ", size_t(stmnt.kind()));
+        return false;
+      }
+    }
+  }
+
+public :
+  explicit Resolver(Tree& tree) : _tree(tree) {}
+
+  /// @brief Opens the scope of @p nspace and declares every function in it.
+  ///   The scope stays open for @ref resolveBody until @ref leave.
+  bool enter(Ref nspace)
+  {
+    _symbols.enter();
+    const auto& decls = _tree.get<Namespace>(nspace).decls;
+    for (auto list = _tree.list(decls); !list.isEmpty(); list.pop())
+    {
+      const auto decl = list.front();
+      if (decl.kind() == Kind::func_defn &&
+        !declare(_tree.get<FuncDefn>(decl).name, decl))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void leave() { _symbols.leave(); }
+
+  /// @brief Resolves the names in the body of @p funcDefn, whose namespace
+  ///   is the innermost one entered
+  /// @pre the body is parsed
+  bool resolveBody(Ref funcDefn)
+  {
+    // TODO: Declare the inputs once functions can take them
+    const auto& block = _tree.get<Block>(_tree.get<FuncDefn>(funcDefn).block);
+    _symbols.enter();
+    bool resolved = true;
+    for (auto stmnts = _tree.list(block.stmnts); !stmnts.isEmpty() && resolved; stmnts.pop())
+    {
+      resolved = resolveStmnt(stmnts.front());
+    }
+    _symbols.leave();
+    return resolved;
+  }
+
+  /// @brief Resolves every parsed body in @p nspace and the namespaces
+  ///   within it
+  bool resolve(Ref nspace)
+  {
+    bool resolved = enter(nspace);
+    const auto& decls = _tree.get<Namespace>(nspace).decls;
+    for (auto list = _tree.list(decls); !list.isEmpty() && resolved; list.pop())
+    {
+      const auto decl = list.front();
+      if (decl.kind() == Kind::nspace)
+      {
+        resolved = resolve(decl);
+      }
+      else if (decl.kind() == Kind::func_defn && _tree.get<FuncDefn>(decl).isParsed())
+      {
+        resolved = resolveBody(decl);
+      }
+    }
+    leave();
+    return resolved;
+  }
+};
+
+/// @brief Binds every name in @p tree to its declaration, between parsing
+///   and code generation
+/// @return false after reporting a name that is declared twice in one scope
+///   or not at all
+inline bool resolve(Tree& tree)
+{
+  Resolver resolver{tree};
+  return resolver.resolve(tree.root());
+}
+
+} // namespace ast
+} // namespace iron
@@ -0,0 +1,66 @@
+#pragma once
+
+// standard includes
+#include <memory>
+#include <string>
+#include <vector>
+
+// iron includes
+#include "iron/optimize.h"
+#include "iron/print.h"
+
+// third-party includes
+#include "llvm/Module.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/Target/TargetSelect.h"
+
+extern char** environ;
+
+namespace iron
+{
+
+/// @brief Optimizes @p module, JIT-compiles it in-process and runs its main,
+///   as if it were a program at @p path.
+///
+/// Each function is compiled to native code the first time it is called, so
+/// a short run pays only for the functions it reaches.
+/// @param exitCode set to what main returns
+/// @return false after reporting an error, without running anything
+inline bool run(std::unique_ptr<llvm::Module> module, const std::string& path,
+    const Optimization& optimization, int& exitCode)
+{
+  if (!optimize(module.get(), optimization)) { return false; }
+
+  auto main = module->getFunction("main");
+  if (main == nullptr || main->isDeclaration())
+  {
+    errorln("There is no main function to run.");
+    return false;
+  }
+
+  llvm::InitializeNativeTarget();
+  std::string error;
+  // The engine owns the module from here on
+  std::unique_ptr<llvm::ExecutionEngine> engine{
+    llvm::EngineBuilder{module.release()}
+      .setEngineKind(llvm::EngineKind::JIT)
+      .setErrorStr(&error)
+      .setOptLevel(codeGenLevel(optimization.level))
+      .create()};
+  if (engine == nullptr)
+  {
+    errorln("Could not create a JIT: ", error.c_str());
+    return false;
+  }
+  static const bool LAZY_COMPILATION_DISABLED = false;
+  engine->DisableLazyCompilation(LAZY_COMPILATION_DISABLED);
+
+  static const bool DESTRUCTORS = true;
+  engine->runStaticConstructorsDestructors(!DESTRUCTORS);
+  exitCode = engine->runFunctionAsMain(main, std::vector<std::string>{path}, environ);
+  engine->runStaticConstructorsDestructors(DESTRUCTORS);
+  return true;
+}
+
+} // namespace iron
@@ -0,0 +1,394 @@
+#pragma once
+
+// standard includes
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// system includes
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// iron includes
+#include "iron/print.h"
+
+namespace iron
+{
+
+/// @brief A compile request, as the server sees it.
+///
+/// The client sends its working directory, its arguments and its own
+/// stdout and stderr. The server writes to those directly, so diagnostics
+/// reach the client's terminal as they are reported.
+struct Request
+{
+  /// @brief The client's working directory, which relative paths in
+  ///   @ref args are relative to
+  std::string cwd;
+  /// @brief The client's arguments, without the program name
+  std::vector<std::string> args;
+  /// @brief The client's stdout
+  FILE* out;
+  /// @brief The client's stderr
+  FILE* err;
+};
+
+/// @return the socket that the server listens on and clients connect to:
+///   $IRON_SERVER, or iron.sock in $XDG_RUNTIME_DIR, or else one in a
+///   directory in /tmp that only this user can use, which is made if it
+///   does not exist. Empty after reporting that the directory in /tmp is
+///   not private.
+inline std::string defaultSocketPath()
+{
+  const char* path = getenv("IRON_SERVER");
+  if (path != nullptr && *path != '\0') { return path; }
+  const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+  if (runtimeDir != nullptr && *runtimeDir != '\0')
+  {
+    return std::string(runtimeDir) + "/iron.sock";
+  }
+
+  // Anyone can make a file in /tmp, so the name alone proves nothing
+  const auto dir = "/tmp/iron-" + std::to_string(getuid());
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+  {
+    errorln("Could not create '", dir, "': ", std::string(strerror(errno)));
+    return {};
+  }
+  struct stat info;
+  if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+    info.st_uid != getuid() || (info.st_mode & 077) != 0)
+  {
+    errorln('\'', dir, "' is not a directory that only you can use. Remove it, or "
+      "set IRON_SERVER to a socket in one.");
+    return {};
+  }
+  return dir + "/server.sock";
+}
+
+namespace detail
+{
+
+/// @return false if @p fd closed or failed before all @p size bytes came
+inline bool readAll(int fd, void* data, size_t size)
+{
+  auto bytes = static_cast<char*>(data);
+  while (size > 0)
+  {
+    const auto count = read(fd, bytes, size);
+    if (count == 0 || (count < 0 && errno != EINTR)) { return false; }
+    if (count > 0)
+    {
+      bytes += count;
+      size -= count;
+    }
+  }
+  return true;
+}
+
+inline bool writeAll(int fd, const void* data, size_t size)
+{
+  auto bytes = static_cast<const char*>(data);
+  while (size > 0)
+  {
+    const auto count = write(fd, bytes, size);
+    if (count < 0 && errno != EINTR) { return false; }
+    if (count > 0)
+    {
+      bytes += count;
+      size -= count;
+    }
+  }
+  return true;
+}
+
+/// @return a socket address for @p path, or false if it is too long
+inline bool toAddress(const std::string& path, sockaddr_un& address)
+{
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path))
+  {
+    errorln("The socket path '", path, "' is too long.");
+    return false;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+/// @brief The file descriptors that go with a request: stdout and stderr
+static const size_t FD_COUNT = 2;
+
+/// @brief The most bytes of working directory and arguments in a request
+static const uint32_t MAX_REQUEST_SIZE = 1 << 20;
+
+/// @return whether the process at the other end of @p fd runs as this user
+inline bool isSameUser(int fd)
+{
+  ucred credentials;
+  socklen_t size = sizeof(credentials);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 &&
+    credentials.uid == getuid();
+}
+
+/// @brief Reads a request from @p fd: its size, then the working
+///   directory and each argument, NUL-terminated. The client's stdout and
+///   stderr come with the size.
+/// @return false if the client sent something else
+inline bool receive(int fd, Request& request)
+{
+  uint32_t size = 0;
+  iovec header{&size, sizeof(size)};
+  char control[CMSG_SPACE(FD_COUNT * sizeof(int))];
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &header;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t count = 0;
+  do { count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC); } while (count < 0 && errno == EINTR);
+  if (count <= 0) { return false; }
+
+  // Every descriptor the client sent is now open here. Only the first pair
+  // is kept, and the rest are closed so a client cannot use up the table.
+  int fds[FD_COUNT] = {-1, -1};
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+    cmsg = CMSG_NXTHDR(&message, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) { continue; }
+
+    const size_t fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const bool isKept = fds[0] < 0 && fdCount == FD_COUNT;
+    for (size_t i=0; i<fdCount; ++i)
+    {
+      int sent = -1;
+      memcpy(&sent, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (isKept) { fds[i] = sent; }
+      else { close(sent); }
+    }
+  }
+  auto open = [](int sent)
+  {
+    if (sent < 0) { return static_cast<FILE*>(nullptr); }
+    FILE* file = fdopen(sent, "w");
+    if (file == nullptr) { close(sent); }
+    return file;
+  };
+  request.out = open(fds[0]);
+  request.err = open(fds[1]);
+  if (request.out == nullptr || request.err == nullptr)
+  {
+    return false;
+  }
+
+  if (count < ssize_t(sizeof(size)) &&
+    !readAll(fd, reinterpret_cast<char*>(&size) + count, sizeof(size) - count))
+  {
+    return false;
+  }
+  if (size > MAX_REQUEST_SIZE) { return false; }
+  std::string payload(size, '\0');
+  if (size > 0 && !readAll(fd, &payload[0], size)) { return false; }
+
+  size_t begin = 0;
+  while (begin < payload.size())
+  {
+    auto end = payload.find('\0', begin);
+    if (end == std::string::npos) { return false; }
+    if (begin == 0) { request.cwd = payload.substr(0, end); }
+    else { request.args.push_back(payload.substr(begin, end - begin)); }
+    begin = end + 1;
+  }
+  return !request.cwd.empty();
+}
+
+} // namespace detail
+
+/// @brief Listens on @p path and calls @p handle(request) for every request,
+///   each on a thread of its own, until the process is killed.
+///
+/// Whatever @p handle returns is sent back as the exit code for the client.
+/// A stale socket that nothing listens on is replaced. Only processes of
+/// the same user are served, since they get files written as this user.
+/// @return false after reporting that the socket could not be set up
+template<typename Tfunc>
+bool serve(const std::string& path, Tfunc&& handle)
+{
+  sockaddr_un address;
+  if (!detail::toAddress(path, address)) { return false; }
+
+  const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0)
+  {
+    errorln("Could not create a socket: ", std::string(strerror(errno)));
+    return false;
+  }
+  auto bindListener = [&]()
+  {
+    return bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+  };
+  bool isBound = bindListener();
+  if (!isBound && errno == EADDRINUSE)
+  {
+    // Only a socket that refuses connections is stale
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool isLive =
+      connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    close(probe);
+    if (isLive)
+    {
+      errorln("An iron server is already listening on '", path, "'");
+      close(listener);
+      return false;
+    }
+    unlink(path.c_str());
+    isBound = bindListener();
+  }
+  if (!isBound || chmod(path.c_str(), 0600) != 0 || listen(listener, SOMAXCONN) != 0)
+  {
+    errorln("Could not listen on '", path, "': ", std::string(strerror(errno)));
+    close(listener);
+    return false;
+  }
+
+  // A client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+  infoln("Listening on ", path);
+  while (true)
+  {
+    const int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED) { continue; }
+      errorln("Could not accept a client: ", std::string(strerror(errno)));
+      break;
+    }
+    if (!detail::isSameUser(client))
+    {
+      errorln("Refused a client of another user");
+      close(client);
+      continue;
+    }
+
+    std::thread{[client, &handle]()
+    {
+      Request request{};
+      int32_t exitCode = -1;
+      if (detail::receive(client, request))
+      {
+        exitCode = handle(request);
+      }
+      if (request.out != nullptr) { fclose(request.out); }
+      if (request.err != nullptr) { fclose(request.err); }
+      // The client waits for this, after everything written to its stdout
+      // and stderr
+      (void) detail::writeAll(client, &exitCode, sizeof(exitCode));
+      close(client);
+    }}.detach();
+  }
+  close(listener);
+  unlink(path.c_str());
+  return false;
+}
+
+/// @brief Sends @p args to the server listening on @p path, to be handled as
+///   if they were given to iron in this process's working directory, with
+///   this process's stdout and stderr.
+/// Nothing is sent to a server of another user.
+/// @param exitCode set to what the server says iron exits with
+/// @return false after reporting that the server could not be reached
+inline bool request(const std::string& path, const std::vector<std::string>& args,
+  int& exitCode)
+{
+  sockaddr_un address;
+  if (!detail::toAddress(path, address)) { return false; }
+
+  std::string payload;
+  {
+    std::vector<char> cwd(4096);
+    while (getcwd(cwd.data(), cwd.size()) == nullptr)
+    {
+      if (errno != ERANGE)
+      {
+        errorln("Could not find the working directory: ", std::string(strerror(errno)));
+        return false;
+      }
+      cwd.resize(cwd.size() * 2);
+    }
+    payload += cwd.data();
+    payload += '\0';
+  }
+  for (const auto& arg : args)
+  {
+    payload += arg;
+    payload += '\0';
+  }
+  if (payload.size() > detail::MAX_REQUEST_SIZE)
+  {
+    errorln("The arguments are too long to send to the server.");
+    return false;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+  {
+    errorln("No iron server is listening on '", path, "'. Start one with iron --server");
+    if (fd >= 0) { close(fd); }
+    return false;
+  }
+  if (!detail::isSameUser(fd))
+  {
+    errorln("The server on '", path, "' is run by another user.");
+    close(fd);
+    return false;
+  }
+
+  // Everything this process wrote must come before what the server writes
+  fflush(stdout);
+  fflush(stderr);
+
+  uint32_t size = payload.size();
+  iovec header{&size, sizeof(size)};
+  const int fds[detail::FD_COUNT] = {STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &header;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  ssize_t sent = 0;
+  do { sent = sendmsg(fd, &message, 0); } while (sent < 0 && errno == EINTR);
+  int32_t code = -1;
+  const bool answered = sent > 0 &&
+    detail::writeAll(fd, reinterpret_cast<char*>(&size) + sent, sizeof(size) - sent) &&
+    detail::writeAll(fd, payload.data(), payload.size()) &&
+    detail::readAll(fd, &code, sizeof(code));
+  close(fd);
+  if (!answered)
+  {
+    errorln("The iron server on '", path, "' hung up.");
+    return false;
+  }
+  exitCode = code;
+  return true;
+}
+
+} // namespace iron
@@ -0,0 +1,478 @@
+#pragma once
+
+// standard includes
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// system includes
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// iron includes
+#include "iron/emit.h"
+#include "iron/file.h"
+#include "iron/generate.h"
+#include "iron/lex.h"
+#include "iron/optimize.h"
+#include "iron/parse.h"
+#include "iron/print.h"
+#include "iron/resolve.h"
+#include "iron/run.h"
+#include "iron/workers.h"
+
+// third-party includes
+#include "llvm/LLVMContext.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace iron
+{
+
+/// @brief How a @ref CompilerSession compiles and reports
+struct SessionOptions
+{
+  /// @brief What to write to the output file
+  Emit emit = Emit::executable;
+  Optimization optimization;
+  /// @brief The number of threads to use
+  size_t jobs = 1;
+  /// @brief Only parse and generate the functions that main can reach
+  bool lazy = false;
+  /// @brief Whether to print what the compiler is doing
+  bool info = false;
+  /// @brief Whether to report errors at all
+  bool errors = true;
+  /// @brief Where to write errors as they are reported. When null, the
+  ///   session keeps them for @ref CompilerSession::takeDiagnostics.
+  FILE* diagnostics = nullptr;
+  /// @brief Where the session makes its directory of temporary files
+  std::string tempRoot = DEFAULT_TEMP_DIR;
+};
+
+/// @brief Removes the temporary directory @p dir and the files in it
+inline void removeTempDir(const std::string& dir)
+{
+  if (DIR* entries = opendir(dir.c_str()))
+  {
+    while (const dirent* entry = readdir(entries))
+    {
+      unlink((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(entries);
+  }
+  rmdir(dir.c_str());
+}
+
+/// @brief A file that has been lexed, parsed and resolved, ready to generate
+///   code from. Generating code only reads it, so several sessions can
+///   generate from one at once.
+struct ParsedFile
+{
+  Shared<File> file;
+  /// @brief The tree refers to these, so they live and move together
+  TokenStream tokens;
+  ast::Tree tree;
+};
+
+/// @brief One user of the compiler: its options, its LLVMContext and target
+///   machine, where its errors go and a directory for its temporary files.
+///
+/// Nothing a session compiles with is shared with other sessions, so a host
+/// can run many sessions at once, each on its own thread. A session itself
+/// is used by one thread at a time. The threads a session compiles on
+/// report to the session, wherever the calling thread reported before.
+class CompilerSession
+{
+private :
+  SessionOptions _options;
+  llvm::LLVMContext _context;
+  std::unique_ptr<llvm::TargetMachine> _machine;
+  /// @brief The session's own temporary directory, made on first use
+  std::string _tempDir;
+  /// @brief Collects the errors when @ref SessionOptions::diagnostics is null
+  FILE* _buffer;
+  char* _data;
+  size_t _size;
+  /// @brief How much of @ref _data @ref takeDiagnostics has returned
+  size_t _taken;
+  LexCode _lexCode;
+
+  /// @brief Reports the way the session says to on the calling thread, for
+  ///   as long as it is alive
+  class Scope
+  {
+  private :
+    Diagnostics _previous;
+
+  public :
+    explicit Scope(const CompilerSession& session) : _previous(Diagnostics::current())
+    {
+      const auto& options = session._options;
+      Diagnostics{options.info, options.errors,
+        (options.diagnostics != nullptr) ? options.diagnostics : session._buffer}.install();
+    }
+    Scope(const Scope&) = delete;
+    ~Scope() { _previous.install(); }
+  };
+
+  /// @return false after reporting an error
+  bool makeTempDir()
+  {
+    if (!_tempDir.empty()) { return true; }
+
+    auto dir = _options.tempRoot + "/iron_session_XXXXXX";
+    if (mkdtemp(&dir[0]) == nullptr)
+    {
+      errorln("Could not create a temporary directory in ", _options.tempRoot);
+      return false;
+    }
+    _tempDir = dir;
+    return true;
+  }
+
+  /// @return the session's target machine, or null after reporting an error
+  llvm::TargetMachine* machine()
+  {
+    if (_machine == nullptr) { _machine.reset(createHostMachine()); }
+    return _machine.get();
+  }
+
+  /// @param code set to the status of lexing @p file
+  static TokenStream tokenize(Shared<File> file, size_t jobs, LexCode& code)
+  {
+    auto tokens = lex(file, jobs);
+    code = iron::lexCode;
+    if (tokens.isEmpty())
+    {
+      switch (code)
+      {
+        case LexCode::ok:
+        {
+          break;
+        }
+        case LexCode::bad_file:
+        {
+          errorln('\'', file->path(), "' is not a valid Iron source file.");
+          break;
+        }
+        case LexCode::no_match:
+        {
+          errorln("Warning: No tokens parsed from '", file->path(), '\'');
+          break;
+        }
+        case LexCode::lex_error:
+        {
+          // The lexer reported what it could not lex
+          errorln("Failed to lex '", file->path(), '\'');
+          break;
+        }
+        default:
+        {
+          errorln("Internal Compiler Error: "
+            "Invalid lex status code (", size_t(code), ") detected at ",
+            __FILE__, ':', size_t(__LINE__));
+          break;
+        }
+      }
+    }
+    return tokens;
+  }
+
+  static bool makeAst(Shared<File> file, TokenRange tokens, ast::Tree& tree, size_t jobs,
+    bool lazy)
+  {
+    const auto root = lazy ?
+      ast::parseSignatures(tokens, tree) :
+      ast::parse(tokens, tree, jobs);
+    if (!root)
+    {
+      errorln("Failed to parse '", file->path(), "'");
+      return false;
+    }
+    // Lazily parsed bodies are resolved as they are parsed
+    if (!lazy && !ast::resolve(tree))
+    {
+      errorln("Failed to resolve the names in '", file->path(), "'");
+      return false;
+    }
+    return true;
+  }
+
+public :
+  explicit CompilerSession(SessionOptions options = SessionOptions{}) :
+      _options(std::move(options)), _buffer(nullptr), _data(nullptr), _size(0),
+      _taken(0), _lexCode(LexCode::ok)
+  {
+    // Sessions on other threads may be using LLVM already
+    enableThreads();
+    if (_options.diagnostics == nullptr)
+    {
+      // If there is no memory for a buffer, errors go to stderr
+      _buffer = open_memstream(&_data, &_size);
+    }
+  }
+  CompilerSession(const CompilerSession&) = delete;
+  ~CompilerSession()
+  {
+    // Anything left behind belongs to this session alone
+    if (!_tempDir.empty()) { removeTempDir(_tempDir); }
+    if (_buffer != nullptr) { fclose(_buffer); }
+    free(_data);
+  }
+
+  const SessionOptions& options() const { return _options; }
+
+  /// @return the status of lexing the file the session last compiled or ran
+  ///   on its own
+  LexCode lexCode() const { return _lexCode; }
+
+  /// @brief Lexes, parses and resolves the whole of @p file, whatever
+  ///   @ref SessionOptions::lazy says
+  /// @return the parsed file, or null after reporting an error
+  Shared<ParsedFile> parse(Shared<File> file)
+  {
+    Scope scope{*this};
+    static const bool EAGER = false;
+    auto parsed = std::make_shared<ParsedFile>();
+    parsed->file = std::move(file);
+    parsed->tokens = tokenize(parsed->file, _options.jobs, _lexCode);
+    if (parsed->tokens.isEmpty() ||
+      !makeAst(parsed->file, parsed->tokens.all(), parsed->tree, _options.jobs, EAGER))
+    {
+      parsed.reset();
+    }
+    return parsed;
+  }
+
+  /// @brief Lexes, parses and resolves the whole of the file at @p path,
+  ///   whatever @ref SessionOptions::lazy says
+  /// @param mayMap false to read the file into memory and close it, for a
+  ///   parsed file that is kept after this call. A mapped file that is
+  ///   truncated while it is kept faults whoever reads it, and keeps its
+  ///   descriptor open.
+  /// @return the parsed file, or null after reporting an error
+  Shared<ParsedFile> parse(const std::string& path, bool mayMap = true)
+  {
+    auto file = std::make_shared<File>(path, mayMap);
+    if (!mayMap) { file->close(); }
+    return parse(std::move(file));
+  }
+
+  /// @brief Generates code for @p parsed and writes it to @p outfile
+  /// @return false after reporting an error
+  bool generate(const ParsedFile& parsed, const std::string& outfile)
+  {
+    Scope scope{*this};
+    if (!makeTempDir()) { return false; }
+
+    const auto kind = _options.emit;
+    const auto& optimization = _options.optimization;
+    if (_options.jobs > 1 && !outfile.empty() &&
+      (kind == Emit::object || kind == Emit::executable))
+    {
+      return generateParallel(parsed.tree, outfile, kind, optimization, _options.jobs,
+        _tempDir);
+    }
+    return optimizeAndEmit(generateModule(parsed.tree, _context), outfile, kind,
+      optimization, (kind == Emit::ll) ? nullptr : machine(), _tempDir);
+  }
+
+  /// @brief Compiles @p file into @p outfile
+  /// @return false after reporting an error
+  bool compile(Shared<File> file, const std::string& outfile)
+  {
+    Scope scope{*this};
+    if (!_options.lazy)
+    {
+      const auto parsed = parse(std::move(file));
+      return parsed != nullptr && generate(*parsed, outfile);
+    }
+
+    auto tokens = tokenize(file, _options.jobs, _lexCode);
+    ast::Tree tree;
+    const auto kind = _options.emit;
+    return !tokens.isEmpty() &&
+      makeAst(file, tokens.all(), tree, _options.jobs, _options.lazy) &&
+      makeTempDir() &&
+      optimizeAndEmit(generateModuleFromMain(tree, tokens, _context), outfile, kind,
+        _options.optimization, (kind == Emit::ll) ? nullptr : machine(), _tempDir);
+  }
+
+  /// @brief Compiles the file at @p path into @p outfile
+  /// @return false after reporting an error
+  bool compile(const std::string& path, const std::string& outfile)
+  {
+    return compile(std::make_shared<File>(path), outfile);
+  }
+
+  /// @brief Compiles each file in @p paths on its own, on a pool of
+  ///   threads, and links them into @p outfile.
+  ///
+  /// Each file gets an LLVMContext of its own. Its errors are held back
+  /// until every file is done and then reported in the order of @p paths,
+  /// so the errors of different files never interleave.
+  /// @return false after reporting an error in any of the files
+  bool compileFiles(const std::vector<std::string>& paths, const std::string& outfile)
+  {
+    Scope scope{*this};
+    if (_options.emit != Emit::object && _options.emit != Emit::executable)
+    {
+      errorln("Several input files can only be compiled into an object "
+        "file or a program, with --emit obj or exe.");
+      return false;
+    }
+    if (outfile.empty())
+    {
+      errorln("Cannot compile into a nameless output file.");
+      return false;
+    }
+    if (!makeTempDir()) { return false; }
+
+    Machines machines(_options.jobs);
+    std::vector<std::string> objFiles;
+    const bool linked =
+      compileObjects(paths.size(), machines, _options.optimization, _tempDir, objFiles,
+        [&](size_t task, Unit& unit)
+        {
+          // The files are the unit of parallelism, so each is handled on one thread
+          static const size_t SERIAL = 1;
+          static const bool EAGER = false;
+          auto file = std::make_shared<File>(paths[task]);
+          LexCode code;
+          auto tokens = tokenize(file, SERIAL, code);
+          ast::Tree tree;
+          if (tokens.isEmpty() || !makeAst(file, tokens.all(), tree, SERIAL, EAGER))
+          {
+            return false;
+          }
+          if (!iron::generate(tree, unit))
+          {
+            errorln("Failed to compile '", file->path(), "'");
+            return false;
+          }
+          return true;
+        }) &&
+      link(objFiles, _options.emit, outfile);
+    removeObjects(objFiles);
+    return linked;
+  }
+
+  /// @brief JIT-compiles the file at @p path and runs its main
+  /// @param exitCode set to what main returns
+  /// @return false after reporting an error, without running anything
+  bool run(const std::string& path, int& exitCode)
+  {
+    Scope scope{*this};
+    auto file = std::make_shared<File>(path);
+    auto tokens = tokenize(file, _options.jobs, _lexCode);
+    ast::Tree tree;
+    if (tokens.isEmpty() ||
+      !makeAst(file, tokens.all(), tree, _options.jobs, _options.lazy))
+    {
+      return false;
+    }
+
+    auto module = _options.lazy ?
+      generateModuleFromMain(tree, tokens, _context) :
+      generateModule(tree, _context);
+    return module != nullptr &&
+      iron::run(std::move(module), file->path(), _options.optimization, exitCode);
+  }
+
+  /// @return the errors reported since the last call, when the session
+  ///   keeps them (see @ref SessionOptions::diagnostics)
+  std::string takeDiagnostics()
+  {
+    if (_buffer == nullptr) { return {}; }
+    fflush(_buffer);
+    std::string taken{_data + _taken, _size - _taken};
+    _taken = _size;
+    return taken;
+  }
+};
+
+/// @brief Parsed files kept from one session to the next, so that a file
+///   that has not changed is not lexed, parsed and resolved again.
+///
+/// A file counts as unchanged while its inode, size and modification time
+/// stay the same. When more than the capacity are kept, the least recently
+/// used one is dropped. Sessions on several threads may share one.
+class ParsedFiles
+{
+private :
+  struct Entry
+  {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    /// @brief When the entry was last used, by @ref _clock
+    uint64_t used;
+    Shared<const ParsedFile> parsed;
+  };
+
+  std::mutex _mutex;
+  std::unordered_map<std::string, Entry> _entries;
+  uint64_t _clock;
+  size_t _capacity;
+
+  static bool isSame(const Entry& entry, const struct stat& info)
+  {
+    return entry.device == info.st_dev && entry.inode == info.st_ino &&
+      entry.size == info.st_size &&
+      entry.modified.tv_sec == info.st_mtim.tv_sec &&
+      entry.modified.tv_nsec == info.st_mtim.tv_nsec;
+  }
+
+public :
+  static const size_t DEFAULT_CAPACITY = 256;
+
+  explicit ParsedFiles(size_t capacity = DEFAULT_CAPACITY) :
+      _clock(0), _capacity(capacity)
+  {}
+
+  /// @return the parsed file at @p path, which @p session parses if it is
+  ///   not kept or has changed since, or null after reporting an error
+  Shared<const ParsedFile> parse(const std::string& path, CompilerSession& session)
+  {
+    struct stat info;
+    const bool isStatted = stat(path.c_str(), &info) == 0;
+    if (isStatted)
+    {
+      std::lock_guard<std::mutex> lock{_mutex};
+      auto entry = _entries.find(path);
+      if (entry != _entries.end() && isSame(entry->second, info))
+      {
+        entry->second.used = ++_clock;
+        return entry->second.parsed;
+      }
+    }
+
+    // Parsed without the lock, so sessions parse different files at once.
+    // Kept files are read rather than mapped, so that a file written while
+    // it is kept cannot fault the sessions that use it.
+    static const bool MAY_MAP = false;
+    Shared<const ParsedFile> parsed = session.parse(path, MAY_MAP);
+    if (parsed == nullptr || !isStatted) { return parsed; }
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    if (_entries.size() >= _capacity && _entries.count(path) == 0)
+    {
+      auto oldest = _entries.begin();
+      for (auto entry = _entries.begin(); entry != _entries.end(); ++entry)
+      {
+        if (entry->second.used < oldest->second.used) { oldest = entry; }
+      }
+      _entries.erase(oldest);
+    }
+    _entries[path] = {info.st_dev, info.st_ino, info.st_size, info.st_mtim, ++_clock, parsed};
+    return parsed;
+  }
+};
+
+} // namespace iron
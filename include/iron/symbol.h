@@ -0,0 +1,183 @@
+#pragma once
+
+// standard includes
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// iron includes
+#include "iron/print.h"
+#include "iron/range.h"
+
+namespace iron
+{
+
+/// @brief An interned name. Two Symbols are equal exactly when their names
+///   are, so comparing and hashing them never touches the text.
+class Symbol
+{
+private :
+  uint32_t _id;
+
+public :
+  /// @brief The empty name
+  constexpr Symbol() : _id(0) {}
+  explicit constexpr Symbol(uint32_t id) : _id(id) {}
+
+  constexpr uint32_t id() const { return _id; }
+  constexpr bool isEmpty() const { return _id == 0; }
+
+  constexpr bool operator==(Symbol rhs) const { return _id == rhs._id; }
+  constexpr bool operator!=(Symbol rhs) const { return _id != rhs._id; }
+
+  /// @brief The interned text of this name. It lives as long as the process.
+  Ascii text() const;
+  std::string str() const;
+};
+
+/// @brief Maps names to Symbols and back. All members are thread-safe.
+class SymbolTable
+{
+private :
+  struct Hash
+  {
+    size_t operator()(Ascii key) const
+    {
+      // FNV-1a
+      size_t hash = 14695981039346656037ull;
+      for (size_t i=0; i<key.size(); ++i)
+      {
+        hash = (hash ^ ubyte_t(key.at(i))) * 1099511628211ull;
+      }
+      return hash;
+    }
+  };
+
+  struct Equal
+  {
+    bool operator()(Ascii lhs, Ascii rhs) const
+    {
+      return lhs.size() == rhs.size() &&
+        memcmp(&lhs.at(0), &rhs.at(0), lhs.size()) == 0;
+    }
+  };
+
+  /// Names are stored in fixed pages so that @ref text can read them without
+  /// taking the lock; a page never moves once it is published.
+  static const size_t PAGE_BITS = 12;
+  static const size_t PAGE_SIZE = size_t(1) << PAGE_BITS;
+  static const size_t MAX_PAGES = 4096;
+  static const size_t BLOCK_SIZE = 64 * 1024;
+
+  std::mutex _mutex;
+  std::unordered_map<Ascii, uint32_t, Hash, Equal> _ids;
+  Ascii* _pages[MAX_PAGES];
+  uint32_t _count;
+  /// @brief Unused space in the newest block of name storage
+  byte_t* _block;
+  size_t _blockSpace;
+
+public :
+  SymbolTable() : _pages(), _count(1), _block(nullptr), _blockSpace(0)
+  {
+    // Symbol 0 is the empty name
+    _pages[0] = new Ascii[PAGE_SIZE];
+  }
+  SymbolTable(const SymbolTable&) = delete;
+
+  /// @brief The table shared by the whole process
+  static SymbolTable& global()
+  {
+    static SymbolTable table;
+    return table;
+  }
+
+  /// @return the Symbol for @p name, adding it if it is new
+  Symbol intern(Ascii name)
+  {
+    if (name.isEmpty()) { return {}; }
+
+    std::lock_guard<std::mutex> lock{_mutex};
+    const auto found = _ids.find(name);
+    if (found != _ids.end()) { return Symbol{found->second}; }
+
+    if (_count == PAGE_SIZE * MAX_PAGES)
+    {
+      errorln("Internal Compiler Error: Too many distinct names.");
+      abort();
+    }
+
+    const auto text = store(name);
+    const auto id = _count;
+    auto& page = _pages[id >> PAGE_BITS];
+    if (page == nullptr) { page = new Ascii[PAGE_SIZE]; }
+    page[id & (PAGE_SIZE - 1)] = text;
+    _ids.emplace(text, id);
+    ++_count;
+    return Symbol{id};
+  }
+
+  /// @pre @p symbol came from this table
+  Ascii text(Symbol symbol) const
+  {
+    const auto id = symbol.id();
+    return _pages[id >> PAGE_BITS][id & (PAGE_SIZE - 1)];
+  }
+
+private :
+  /// @return a copy of @p name that is never moved or freed
+  Ascii store(Ascii name)
+  {
+    const auto size = name.size();
+    byte_t* copy = nullptr;
+    if (size > BLOCK_SIZE / 4)
+    {
+      copy = static_cast<byte_t*>(malloc(size));
+    }
+    else
+    {
+      if (size > _blockSpace)
+      {
+        _block = static_cast<byte_t*>(malloc(BLOCK_SIZE));
+        _blockSpace = BLOCK_SIZE;
+      }
+      copy = _block;
+      _block += size;
+      _blockSpace -= size;
+    }
+    memcpy(copy, &name.at(0), size);
+    return {copy, copy + size - 1};
+  }
+};
+
+/// @brief The process-wide symbol table
+inline SymbolTable& symbols() { return SymbolTable::global(); }
+
+inline Ascii Symbol::text() const { return symbols().text(*this); }
+
+inline std::string Symbol::str() const
+{
+  const auto name = text();
+  return name.isEmpty() ? std::string{} : std::string{&name.at(0), name.size()};
+}
+
+inline int print(FILE* file, Symbol symbol)
+{
+  return print(file, symbol.text());
+}
+
+} // namespace iron
+
+namespace std
+{
+
+template<>
+struct hash<iron::Symbol>
+{
+  size_t operator()(iron::Symbol symbol) const { return symbol.id(); }
+};
+
+} // namespace std
@@ -1,11 +1,21 @@
 #pragma once
 
+// standard includes
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
 // iron includes
+#include "iron/darray.h"
+#include "iron/file.h"
 #include "iron/print.h"
 #include "iron/range.h"
+#include "iron/symbol.h"
 
 namespace iron
 {
+template<typename Ttype>
+using Shared = std::shared_ptr<Ttype>;
 
 /// @brief The position of a substring in a file
 struct Pos
@@ -17,9 +27,13 @@ struct Pos
 };
 
 /// @brief A syntactic unit of the Iron language
+///
+/// Tokens are kept to 8 bytes so that a large file's token stream stays
+/// small. The text and position of a token are recovered through the
+/// @ref TokenStream that owns it.
 struct Token
 {
-  enum class Type
+  enum class Type : ubyte_t
   {
     bad,
     ampersind,
@@ -58,18 +72,183 @@ struct Token
     tilde
   };
 
+  /// @brief The byte offset of this token in its file
+  uint32_t offset;
+  /// @brief The length of this token in bytes
+  uint16_t size;
   /// @brief The type of token
   Type type;
-  /// @brief The position of this token in its file
-  Pos pos;
-  /// @brief The substring of the file for this token
-  PtrRange<const byte_t> value;
 };
+static_assert(sizeof(Token) == 8, "A Token must be 8 bytes long");
 
-int print(FILE* file, Pos pos)
+inline int print(FILE* file, Pos pos)
 {
   return print(file, pos.row, ',', pos.col);
 }
 
+/// @brief Maps byte offsets in a file to rows and columns
+class LineTable
+{
+private :
+  /// @brief The offset of the first byte of each line
+  Darray<uint32_t> _starts;
+  /// @brief The index of the line found by the previous lookup. It is only
+  ///   a hint, so threads that look up positions at once may race on it.
+  mutable std::atomic<size_t> _last;
+
+public :
+  LineTable() : _last(0) {}
+  LineTable(LineTable&& other) :
+      _starts(std::move(other._starts)), _last(other._last.load())
+  {}
+  LineTable& operator=(LineTable&& other)
+  {
+    _starts = std::move(other._starts);
+    _last = other._last.load();
+    return *this;
+  }
+
+  bool isEmpty() const { return _starts.isEmpty(); }
+
+  /// @brief Indexes the start of every line of @p bytes in a single pass
+  void build(PtrRange<const byte_t> bytes)
+  {
+    _starts.pushBack(0);
+    if (bytes.isEmpty()) { return; }
+
+    const byte_t* begin = &bytes.front();
+    const byte_t* end = begin + bytes.size();
+    const byte_t* newline = begin;
+    while ((newline = static_cast<const byte_t*>(
+        memchr(newline, '\n', end - newline))) != nullptr)
+    {
+      ++newline;
+      _starts.pushBack(static_cast<uint32_t>(newline - begin));
+    }
+  }
+
+  /// @pre @ref build has been called
+  Pos pos(uint32_t offset) const
+  {
+    auto starts = _starts.all();
+    const auto count = starts.size();
+
+    // The parser asks for positions in mostly ascending order, so first try
+    // the line of the previous lookup and the one after it.
+    auto line = _last.load(std::memory_order_relaxed);
+    if (starts[line] > offset || (line + 1 < count && starts[line + 1] <= offset))
+    {
+      ++line;
+      if (line >= count || starts[line] > offset ||
+        (line + 1 < count && starts[line + 1] <= offset))
+      {
+        // Find the last line that starts at or before offset
+        size_t lo = 0;
+        size_t hi = count;
+        while (hi - lo > 1)
+        {
+          const auto mid = lo + (hi - lo) / 2;
+          if (starts[mid] <= offset) { lo = mid; } else { hi = mid; }
+        }
+        line = lo;
+      }
+    }
+    _last.store(line, std::memory_order_relaxed);
+
+    return Pos{offset - starts[line] + 1, line + 1};
+  }
+};
+
+class TokenRange;
+
+/// @brief The tokens of one file, along with what is needed to recover their
+///   text and their positions
+class TokenStream
+{
+private :
+  Shared<File> _file;
+  Darray<Token> _tokens;
+  /// @brief Built on the first call to @ref pos
+  mutable LineTable _lines;
+
+public :
+  TokenStream() = default;
+  TokenStream(Shared<File> file, Darray<Token>&& tokens) :
+      _file(file), _tokens(std::move(tokens))
+  {}
+
+  TokenRange all() const;
+  size_t count() const { return _tokens.count(); }
+  Shared<File> file() const { return _file; }
+  bool isEmpty() const { return _tokens.isEmpty(); }
+
+  /// @brief Builds the line table now rather than on the first call to
+  ///   @ref pos. Call this before looking up positions on several threads.
+  void indexLines() const
+  {
+    if (_lines.isEmpty()) { _lines.build(_file->all()); }
+  }
+
+  Pos pos(const Token& token) const
+  {
+    indexLines();
+    return _lines.pos(token.offset);
+  }
+
+  Ascii value(const Token& token) const
+  {
+    const byte_t* begin = &_file->all().front() + token.offset;
+    return {begin, begin + token.size - 1};
+  }
+
+  /// @pre @p token belongs to this stream
+  /// @return the index of @p token in this stream
+  size_t index(const Token& token) const { return &token - &_tokens.at(0); }
+
+  /// @return the @p count tokens starting at index @p first
+  TokenRange range(size_t first, size_t count) const;
+};
+
+/// @brief A cursor over part of a @ref TokenStream
+class TokenRange : public PtrRange<const Token>
+{
+private :
+  const TokenStream* _stream;
+
+public :
+  TokenRange() : _stream(nullptr) {}
+  TokenRange(PtrRange<const Token> tokens, const TokenStream* stream) :
+      PtrRange<const Token>(tokens), _stream(stream)
+  {}
+
+  const TokenStream* stream() const { return _stream; }
+
+  /// @return the type of the token @p index tokens from the front, or
+  ///   Token::Type::bad past the end, so lookahead can never run off the range
+  Token::Type type(size_t index = 0) const
+  {
+    return (!isEmpty() && index < size()) ? at(index).type : Token::Type::bad;
+  }
+  /// @return the position of the token @p index tokens from the front
+  Pos pos(size_t index = 0) const { return _stream->pos(at(index)); }
+  /// @return the text of the token @p index tokens from the front
+  Ascii value(size_t index = 0) const { return _stream->value(at(index)); }
+  /// @return the interned text of the token @p index tokens from the front
+  Symbol symbol(size_t index = 0) const { return symbols().intern(value(index)); }
+};
+
+inline TokenRange TokenStream::all() const
+{
+  const auto tokens = _tokens.all();
+  return {{&tokens.at(0), &tokens.at(0) + tokens.size() - 1}, this};
+}
+
+inline TokenRange TokenStream::range(size_t first, size_t count) const
+{
+  if (count == 0) { return {{}, this}; }
+  const Token* begin = &_tokens.at(first);
+  return {{begin, begin + count - 1}, this};
+}
+
 } // namespace iron
 
@@ -0,0 +1,385 @@
+#pragma once
+
+// standard includes
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// system includes
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+// iron includes
+#include "iron/cache.h"
+#include "iron/emit.h"
+#include "iron/file.h"
+#include "iron/generate.h"
+#include "iron/lex.h"
+#include "iron/optimize.h"
+#include "iron/parse.h"
+#include "iron/print.h"
+#include "iron/resolve.h"
+#include "iron/session.h"
+#include "iron/workers.h"
+
+// third-party includes
+#include "llvm/Target/TargetMachine.h"
+
+namespace iron
+{
+
+/// @brief Builds one file into a program or an object file again and again,
+///   redoing only what an edit since the last build touched.
+///
+/// The functions are split into partitions where their names say, and each
+/// partition is compiled into an object file of its own that is kept
+/// between builds. The file is relexed around the edit (see @ref relex) and
+/// only its signatures are parsed. A partition keeps its object while its
+/// own signatures and bodies are unchanged, and so are the signatures of
+/// the functions its bodies name; the rest have their bodies parsed,
+/// resolved and generated, and the objects are linked again.
+///
+/// Since where a partition ends depends only on the names around it, and a
+/// partition depends only on the functions it names, adding or removing a
+/// function rebuilds the partition it is in and those that call it, and
+/// leaves the others as they were.
+class IncrementalBuild
+{
+private :
+  std::string _path;
+  std::string _outfile;
+  SessionOptions _options;
+  /// @brief Holds the objects of the partitions, made on the first build
+  std::string _tempDir;
+  /// @brief What the last build lexed, which the next build relexes
+  TokenStream _tokens;
+  /// @brief The object file of each partition built so far, by its key
+  std::unordered_map<std::string, std::string> _objFiles;
+  Machines _machines;
+
+  using Clock = std::chrono::steady_clock;
+
+  /// @brief The number of functions in a partition on average: few enough
+  ///   that an edit regenerates little, and enough that linking a large file
+  ///   stays quick
+  static const size_t FUNCTIONS_PER_PARTITION = 32;
+  /// @brief Ends a partition in a run of names none of which end one
+  static const size_t MAX_FUNCTIONS_PER_PARTITION = 4 * FUNCTIONS_PER_PARTITION;
+
+  /// @return false after reporting an error
+  bool makeTempDir()
+  {
+    if (!_tempDir.empty()) { return true; }
+
+    auto dir = _options.tempRoot + "/iron_watch_XXXXXX";
+    if (mkdtemp(&dir[0]) == nullptr)
+    {
+      errorln("Could not create a temporary directory in ", _options.tempRoot);
+      return false;
+    }
+    _tempDir = dir;
+    return true;
+  }
+
+  /// @return the bytes of @p tokens from the start of its token @p first to
+  ///   the end of the @p count tokens from there
+  static Ascii bytesOf(const TokenStream& tokens, uint32_t first, uint32_t count)
+  {
+    const auto all = tokens.all();
+    const auto& front = all.at(first);
+    const auto& back = all.at(first + count - 1);
+    const byte_t* begin = &tokens.file()->all().front();
+    return {begin + front.offset, begin + back.offset + back.size - 1};
+  }
+
+  /// @return for each of @p funcDefns, the hash of its signature: the
+  ///   tokens from the end of the body before it to the start of its own
+  static Darray<uint64_t> hashSignatures(const TokenStream& tokens, const ast::Tree& tree,
+    const Darray<ast::Ref>& funcDefns)
+  {
+    Darray<uint64_t> hashes;
+    std::string text;
+    size_t next = 0;
+    for (size_t i=0; i<funcDefns.count(); ++i)
+    {
+      const auto& body = tree.get<ast::FuncDefn>(funcDefns.at(i)).body;
+      text.clear();
+      for (; next < body.first; ++next)
+      {
+        auto value = tokens.value(tokens.all().at(next));
+        text.append(&value.front(), value.size());
+        text += ' ';
+      }
+      hashes.pushBack(hash128({&text.front(), &text.back()}).low);
+      next = body.first + body.count;
+    }
+    return hashes;
+  }
+
+  /// @return @p funcDefns split after each function whose name hashes to a
+  ///   multiple of FUNCTIONS_PER_PARTITION, and after MAX_FUNCTIONS_PER_PARTITION
+  ///   functions at most
+  static Darray<Partition> partitionByName(const ast::Tree& tree,
+    const Darray<ast::Ref>& funcDefns)
+  {
+    Darray<Partition> partitions;
+    size_t begin = 0;
+    for (size_t f=0; f<funcDefns.count(); ++f)
+    {
+      const auto name = tree.get<ast::FuncDefn>(funcDefns.at(f)).name.text();
+      if (hash128(name).low % FUNCTIONS_PER_PARTITION == 0 ||
+        f + 1 - begin == MAX_FUNCTIONS_PER_PARTITION || f + 1 == funcDefns.count())
+      {
+        partitions.pushBack(Partition{begin, f + 1});
+        begin = f + 1;
+      }
+    }
+    return partitions;
+  }
+
+public :
+  /// @param options how to compile. Only Emit::executable and Emit::object
+  ///   are made of objects that can be kept.
+  IncrementalBuild(std::string path, std::string outfile, SessionOptions options) :
+      _path(std::move(path)), _outfile(std::move(outfile)), _options(std::move(options)),
+      _machines(std::max<size_t>(1, _options.jobs))
+  {}
+  IncrementalBuild(const IncrementalBuild&) = delete;
+  ~IncrementalBuild()
+  {
+    if (!_tempDir.empty()) { removeTempDir(_tempDir); }
+  }
+
+  /// @brief Builds the file as it is now, and prints how much was rebuilt
+  /// @return false after reporting an error
+  bool build()
+  {
+    const auto start = Clock::now();
+    if (!makeTempDir()) { return false; }
+
+    // An editor may write the file while it is being watched, so the tokens
+    // kept for the next build must not point into a mapping of it
+    static const bool MAY_MAP = false;
+    auto file = std::make_shared<File>(_path, MAY_MAP);
+    if (!file->isOpen()) { return false; }
+    auto lexed = _tokens.isEmpty() ? lex(file) : relex(_tokens, file);
+    if (lexed.isEmpty())
+    {
+      errorln("Failed to lex '", _path, "'");
+      return false;
+    }
+    _tokens = std::move(lexed);
+    const auto& tokens = _tokens;
+
+    ast::Tree tree;
+    if (!ast::parseSignatures(tokens.all(), tree))
+    {
+      errorln("Failed to parse '", _path, "'");
+      return false;
+    }
+    Darray<ast::Ref> funcDefns;
+    collectFuncDefns(tree, tree.root(), funcDefns);
+    if (funcDefns.isEmpty())
+    {
+      errorln("There are no functions to compile in '", _path, "'");
+      return false;
+    }
+    ast::Resolver resolver{tree};
+    if (!resolver.enter(tree.root()))
+    {
+      errorln("Failed to resolve the names in '", _path, "'");
+      return false;
+    }
+
+    // Each partition is keyed by the signatures and bodies of its functions,
+    // and by the signature of every function that a name in its bodies could
+    // be. A name that is not a function is keyed as such, so that adding a
+    // function of that name rebuilds the partition.
+    const auto signatures = hashSignatures(tokens, tree, funcDefns);
+    std::unordered_map<std::string, uint64_t> signatureOf;
+    for (size_t f=0; f<funcDefns.count(); ++f)
+    {
+      auto name = tree.get<ast::FuncDefn>(funcDefns.at(f)).name.text();
+      signatureOf[std::string{&name.front(), name.size()}] = signatures.at(f);
+    }
+    const auto partitions = partitionByName(tree, funcDefns);
+    const size_t count = partitions.count();
+    std::vector<std::string> keys(count);
+    Darray<size_t> changed;
+    for (size_t i=0; i<count; ++i)
+    {
+      const auto part = partitions.at(i);
+      std::string text;
+      auto appendHash = [&](uint64_t hash)
+      {
+        text.append(reinterpret_cast<const char*>(&hash), sizeof(hash));
+      };
+      for (size_t f=part.begin; f<part.end; ++f)
+      {
+        const auto& defn = tree.get<ast::FuncDefn>(funcDefns.at(f));
+        appendHash(signatures.at(f));
+        auto body = bytesOf(tokens, defn.body.first, defn.body.count);
+        text.append(&body.front(), body.size());
+        text += '\0';
+        for (uint32_t t=defn.body.first; t<defn.body.first + defn.body.count; ++t)
+        {
+          const auto& token = tokens.all().at(t);
+          if (token.type != Token::Type::identifier) { continue; }
+          auto value = tokens.value(token);
+          const auto signature = signatureOf.find(std::string{&value.front(), value.size()});
+          if (signature == signatureOf.end()) { text += '?'; }
+          else { appendHash(signature->second); }
+        }
+      }
+      keys[i] = hash128({&text.front(), &text.back()}).hex();
+      if (_objFiles.count(keys[i]) == 0) { changed.pushBack(i); }
+    }
+
+    // Parsing and resolving add to the tree, so they happen on this thread
+    for (size_t c=0; c<changed.count(); ++c)
+    {
+      const auto part = partitions.at(changed.at(c));
+      for (size_t f=part.begin; f<part.end; ++f)
+      {
+        if (!ast::parseBody(tokens, funcDefns.at(f), tree)) { return false; }
+        if (!resolver.resolveBody(funcDefns.at(f)))
+        {
+          errorln("Failed to resolve the names in '", _path, "'");
+          return false;
+        }
+      }
+    }
+
+    std::vector<std::string> objFiles;
+    const bool compiled =
+      compileObjects(changed.count(), _machines, _options.optimization, _tempDir, objFiles,
+        [&](size_t task, Unit& unit)
+        {
+          return generatePartition(tree, funcDefns, partitions.at(changed.at(task)), unit);
+        });
+    for (size_t c=0; c<changed.count(); ++c)
+    {
+      if (!objFiles[c].empty()) { _objFiles[keys[changed.at(c)]] = objFiles[c]; }
+    }
+    if (!compiled) { return false; }
+
+    std::vector<std::string> linked;
+    for (const auto& key : keys) { linked.push_back(_objFiles.at(key)); }
+    if (!link(linked, _options.emit, _outfile)) { return false; }
+
+    // Only the objects of this build are kept for the next one
+    for (auto entry = _objFiles.begin(); entry != _objFiles.end(); )
+    {
+      if (std::find(keys.begin(), keys.end(), entry->first) == keys.end())
+      {
+        unlink(entry->second.c_str());
+        entry = _objFiles.erase(entry);
+      }
+      else
+      {
+        ++entry;
+      }
+    }
+
+    const std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+    println(stdout, "Rebuilt ", changed.count(), " of ", count, " partitions of '", _path,
+      "' in ", size_t(elapsed.count()), " ms");
+    // Whoever watches the output waits for this line
+    fflush(stdout);
+    return true;
+  }
+};
+
+/// @brief Calls @p rebuild() now and after every time the file at @p path
+///   is written, until the process is interrupted or terminated.
+///
+/// The directory of the file is watched rather than the file itself, since
+/// many editors save by writing a new file and renaming it over the old
+/// one. Events that come in quick succession are taken as one save.
+/// SIGINT and SIGTERM end the watch, so that the caller can clean up.
+/// @return false after reporting that the file could not be watched
+template<typename Tfunc>
+bool watch(const std::string& path, Tfunc&& rebuild)
+{
+  const auto slash = path.rfind('/');
+  const std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+  const std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+  // The signals are blocked on every thread started from here on, and read
+  // from a descriptor alongside the events
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigset_t previous;
+  pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+  const int fd = inotify_init1(IN_CLOEXEC);
+  const int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+  auto stop = [&]()
+  {
+    if (fd >= 0) { close(fd); }
+    if (signalFd >= 0) { close(signalFd); }
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  };
+  if (fd < 0 || signalFd < 0 ||
+    inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+  {
+    errorln("Could not watch '", path, "': ", std::string(strerror(errno)));
+    stop();
+    return false;
+  }
+
+  /// @brief How long to wait for more events once one comes in
+  static const int SETTLE_MS = 10;
+  alignas(inotify_event) char buffer[4096];
+  (void) rebuild();
+  infoln("Watching '", path, "' for changes");
+  while (true)
+  {
+    bool isChanged = false;
+    int timeout = -1;
+    while (true)
+    {
+      pollfd ready[] = {{fd, POLLIN, 0}, {signalFd, POLLIN, 0}};
+      const int polled = poll(ready, 2, timeout);
+      if (polled == 0) { break; }
+      if (polled > 0 && ready[1].revents != 0)
+      {
+        // Taken, so that it is not delivered once it is unblocked
+        signalfd_siginfo info;
+        (void) read(signalFd, &info, sizeof(info));
+        stop();
+        return true;
+      }
+      const auto size = (polled < 0) ? -1 : read(fd, buffer, sizeof(buffer));
+      if (size < 0)
+      {
+        if (errno == EINTR) { continue; }
+        errorln("Stopped watching '", path, "': ", std::string(strerror(errno)));
+        stop();
+        return false;
+      }
+      for (ssize_t at=0; at<size; )
+      {
+        const auto event = reinterpret_cast<const inotify_event*>(buffer + at);
+        if (event->len > 0 && name == event->name) { isChanged = true; }
+        at += sizeof(inotify_event) + event->len;
+      }
+      // Only a change to the file ends the wait; then more are gathered
+      timeout = isChanged ? SETTLE_MS : -1;
+    }
+    if (isChanged) { (void) rebuild(); }
+  }
+}
+
+} // namespace iron
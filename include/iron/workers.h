@@ -0,0 +1,123 @@
+#pragma once
+
+// standard includes
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// iron includes
+#include "iron/print.h"
+
+namespace iron
+{
+
+/// @brief A contiguous run of task indices owned by one worker. The owner
+///   takes tasks from the front; idle workers steal from the back.
+class TaskQueue
+{
+private :
+  std::mutex _mutex;
+  size_t _front;
+  size_t _back;
+
+public :
+  TaskQueue() : _front(0), _back(0) {}
+
+  void assign(size_t front, size_t back)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _front = front;
+    _back = back;
+  }
+
+  /// @brief Takes the next task of the owner
+  /// @return false if the queue is empty
+  bool pop(size_t& task)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_front == _back) { return false; }
+    task = _front++;
+    return true;
+  }
+
+  /// @brief Takes the back half of the queue, rounded up
+  /// @return false if the queue is empty
+  bool steal(size_t& front, size_t& back)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_front == _back) { return false; }
+    back = _back;
+    _back -= (_back - _front + 1) / 2;
+    front = _back;
+    return true;
+  }
+};
+
+/// @brief Calls @p task(index, worker) once for every index below
+///   @p taskCount, spread over @p threadCount workers.
+///
+/// The indices start out split evenly among the workers, so tasks of equal
+/// cost never move. A worker that runs out steals half of what another has
+/// left, which keeps every thread busy when task costs vary. The calling
+/// thread is worker 0. @p worker is below @p threadCount and no two tasks
+/// with the same worker run at once, so it can index per-worker state.
+/// Every worker reports diagnostics as the calling thread does.
+template<typename Tfunc>
+void runTasks(size_t taskCount, size_t threadCount, Tfunc&& task)
+{
+  threadCount = std::max<size_t>(1, std::min(threadCount, taskCount));
+  if (threadCount == 1)
+  {
+    for (size_t i=0; i<taskCount; ++i) { task(i, size_t(0)); }
+    return;
+  }
+
+  std::unique_ptr<TaskQueue[]> queues{new TaskQueue[threadCount]};
+  for (size_t i=0; i<threadCount; ++i)
+  {
+    queues[i].assign(taskCount * i / threadCount, taskCount * (i + 1) / threadCount);
+  }
+
+  auto work = [&](size_t worker)
+  {
+    auto& own = queues[worker];
+    while (true)
+    {
+      size_t index = 0;
+      while (own.pop(index)) { task(index, worker); }
+
+      // Steal from the other workers, nearest first. Finding every queue
+      // empty means each remaining task is held by a worker that will run
+      // it, so this one can stop.
+      bool stole = false;
+      for (size_t i=1; i<threadCount && !stole; ++i)
+      {
+        size_t front = 0;
+        size_t back = 0;
+        if (queues[(worker + i) % threadCount].steal(front, back))
+        {
+          own.assign(front, back);
+          stole = true;
+        }
+      }
+      if (!stole) { return; }
+    }
+  };
+
+  const auto diagnostics = Diagnostics::current();
+  std::vector<std::thread> threads;
+  for (size_t i=1; i<threadCount; ++i)
+  {
+    threads.emplace_back([&diagnostics, &work, i]()
+    {
+      diagnostics.install();
+      work(i);
+    });
+  }
+  work(0);
+  for (auto& thread : threads) { thread.join(); }
+}
+
+} // namespace iron
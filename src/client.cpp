@@ -0,0 +1,30 @@
+// standard includes
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// iron includes
+#include "iron/server.h"
+
+// A thin client for iron --server. It takes the same arguments as iron and
+// has the server compile in its place, so it starts quickly and does not
+// load LLVM at all.
+int main(int argc, char* argv[])
+{
+  if (getenv("INFO") != nullptr) { iron::infoOn = true; }
+  if (getenv("SILENT") != nullptr) { iron::errorOn = false; }
+
+  std::vector<std::string> args;
+  // The server does not see this process's environment
+  if (getenv("IRON_CACHE") != nullptr)
+  {
+    args.emplace_back("--cache");
+    args.emplace_back(getenv("IRON_CACHE"));
+  }
+  for (int i=1; i<argc; ++i) { args.emplace_back(argv[i]); }
+
+  const auto socketPath = iron::defaultSocketPath();
+  int exitCode = 0;
+  if (socketPath.empty() || !iron::request(socketPath, args, exitCode)) { return -1; }
+  return exitCode;
+}
@@ -0,0 +1,4 @@
+// iron includes
+#include "iron/lex.h"
+
+__thread iron::LexCode iron::lexCode = iron::LexCode::ok;
@@ -1,81 +1,80 @@
 // standard includes
 #include <cstdlib>
-#include <unistd.h>
+#include <getopt.h>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 // iron includes
-#include "iron/generate.h"
-#include "iron/lex.h"
-#include "iron/parse.h"
+#include "iron/cache.h"
+#include "iron/server.h"
+#include "iron/session.h"
+#include "iron/watch.h"
 
 using File = iron::File;
-using LexCode = iron::LexCode;
+using String = std::string;
 template<typename Ttype>
 using Shared = std::shared_ptr<Ttype>;
-using Token = iron::Token;
-using AstNode = iron::ast::Node;
-template<typename Ttype>
-using PtrRange = iron::PtrRange<Ttype>;
-using String = std::string;
 template<typename Ttype>
 using Vector = std::vector<Ttype>;
 
-auto tokenize(Shared<File> file) -> decltype(iron::lex(file))
-{
-  auto tokens = iron::lex(file);
-  if (tokens.isEmpty())
-  {
-    switch (iron::lexCode)
-    {
-      case LexCode::ok:
-      {
-        break;
-      }
-      case LexCode::bad_file:
-      {
-        iron::errorln("Expected a file name as the first argument to iron.");
-        iron::errorln('\'', file->path(), "' is not a valid Iron source file.");
-        break;
-      }
-      case LexCode::no_match:
-      {
-        iron::errorln("Warning: No tokens parsed from '", file->path(), '\'');
-        break;
-      }
-      default:
-      {
-        iron::errorln("Internal Compiler Error: "
-          "Invalid lex status code (", iron::lexCode, ") detected at ",
-          __FILE__, ':', __LINE__);
-        break;
-      }
-    }
-  }
-  return std::move(tokens);
-}
-
-Shared<AstNode> makeAst(Shared<File> file, PtrRange<Token> tokens)
-{
-  auto ast = iron::ast::parse(tokens);
-  if (!ast)
-  {
-    iron::errorln("Failed to parse '", file->path(), "'");
-  }
-  return ast;
-}
-
 struct Options
 {
   Vector<String> ins;
   String out;
+  /// @brief JIT-compile the program and run it instead of writing an output
+  ///   file, exiting with its exit code
+  bool run = false;
+  /// @brief How to compile
+  iron::SessionOptions session;
+  /// @brief Where to keep outputs between runs, or empty to keep none
+  String cacheDir;
+  /// @brief How many bytes the cache may hold
+  uint64_t cacheLimit = iron::Cache::DEFAULT_LIMIT;
+  /// @brief Print the statistics of the cache and exit
+  bool cacheStats = false;
+  /// @brief Serve compile requests on this socket instead of compiling
+  String server;
+  /// @brief Build again whenever the input file is written
+  bool watch = false;
+  /// @brief False once an option has a value that is not valid, which has
+  ///   been reported
+  bool isValid = true;
+
+  /// @return everything besides the source that the output depends on
+  String settings() const
+  {
+    String text = iron::COMPILER_BUILD;
+    text += " emit=" + std::to_string(size_t(session.emit));
+    text += " O=" + std::to_string(size_t(session.optimization.level));
+    text += " passes=" + session.optimization.passes;
+    text += session.lazy ? " lazy" : "";
+    // Partitioned code is laid out differently than a single module
+    text += (session.jobs > 1) ? " partitioned" : "";
+    return text;
+  }
 
   static Options parse(int argc, char* argv[])
   {
     opterr = 0;
-    const char options[] = "-o:";
+    const char options[] = "-j:o:O:";
+    const option longOptions[] =
+    {
+      {"cache", required_argument, nullptr, 'c'},
+      {"cache-limit", required_argument, nullptr, 'L'},
+      {"cache-stats", no_argument, nullptr, 's'},
+      {"emit", required_argument, nullptr, 'e'},
+      {"lazy", no_argument, nullptr, 'l'},
+      {"passes", required_argument, nullptr, 'p'},
+      {"run", no_argument, nullptr, 'r'},
+      {"server", optional_argument, nullptr, 'S'},
+      {"watch", no_argument, nullptr, 'w'},
+      {nullptr, 0, nullptr, 0}
+    };
 
     Options opts;
-    int flag = getopt(argc, argv, options);
+    if (getenv("IRON_CACHE") != nullptr) { opts.cacheDir = getenv("IRON_CACHE"); }
+    int flag = getopt_long(argc, argv, options, longOptions, nullptr);
     while (flag != -1)
     {
       switch (flag)
@@ -86,54 +85,298 @@ struct Options
           opts.ins.emplace_back(optarg);
           break;
         }
+        case 'j' :
+        {
+          const auto jobs = strtoul(optarg, nullptr, 10);
+          if (jobs == 0)
+          {
+            iron::errorln("-j needs a positive thread count, not '", String(optarg), '\'');
+            opts.isValid = false;
+            break;
+          }
+          opts.session.jobs = jobs;
+          break;
+        }
+        case 'c' :
+        {
+          opts.cacheDir = String(optarg);
+          break;
+        }
+        case 'L' :
+        {
+          const auto megabytes = strtoull(optarg, nullptr, 10);
+          if (megabytes == 0)
+          {
+            iron::errorln("--cache-limit needs a positive number of megabytes, not '",
+              String(optarg), '\'');
+            opts.isValid = false;
+            break;
+          }
+          opts.cacheLimit = uint64_t(megabytes) << 20;
+          break;
+        }
+        case 's' :
+        {
+          opts.cacheStats = true;
+          break;
+        }
+        case 'e' :
+        {
+          if (!iron::toEmit(String(optarg), opts.session.emit))
+          {
+            iron::errorln("--emit needs one of ll, asm, obj or exe, not '",
+              String(optarg), '\'');
+            opts.isValid = false;
+          }
+          break;
+        }
+        case 'l' :
+        {
+          opts.session.lazy = true;
+          break;
+        }
         case 'o' :
         {
           opts.out = String(optarg);
           break;
         }
+        case 'O' :
+        {
+          if (!iron::toOptLevel(String(optarg), opts.session.optimization.level))
+          {
+            iron::errorln("Expected -O0, -O1, -O2, -O3 or -Os, not -O", String(optarg));
+            opts.isValid = false;
+          }
+          break;
+        }
+        case 'p' :
+        {
+          // Checked against the known passes once there is a module to run them on
+          opts.session.optimization.passes = String(optarg);
+          break;
+        }
+        case 'r' :
+        {
+          opts.run = true;
+          break;
+        }
+        case 'S' :
+        {
+          opts.server = (optarg != nullptr) ? String(optarg) : iron::defaultSocketPath();
+          if (opts.server.empty()) { opts.isValid = false; }
+          break;
+        }
+        case 'w' :
+        {
+          opts.watch = true;
+          break;
+        }
         default :
         {
           iron::errorln("Unhandled option: ", (char) optopt);
           break;
         }
       }
-      flag = getopt(argc, argv, options);
+      flag = getopt_long(argc, argv, options, longOptions, nullptr);
     }
 
-    return std::move(opts);
+    return opts;
   }
 };
 
-int main(int argc, char* argv[])
+/// @brief Builds the input file that @p options name, and builds it again
+///   every time it is written, until interrupted
+/// @return false after reporting why it cannot
+bool watch(const Options& options)
 {
-  using File = iron::File;
+  const auto& session = options.session;
+  if (options.ins.size() > 1 || options.run || session.lazy)
+  {
+    iron::errorln("--watch takes a single input file, and neither --run nor --lazy.");
+    return false;
+  }
+  if ((session.emit != iron::Emit::object && session.emit != iron::Emit::executable) ||
+    options.out.empty())
+  {
+    iron::errorln("--watch builds an object file or a program, with --emit obj or exe "
+      "and -o.");
+    return false;
+  }
 
-  if (getenv("INFO") != nullptr) { iron::infoOn = true; }
-  if (getenv("SILENT") != nullptr) { iron::errorOn = false; }
+  iron::IncrementalBuild build{options.ins.front(), options.out, session};
+  return iron::watch(options.ins.front(), [&]() { return build.build(); });
+}
 
-  auto options = Options::parse(argc, argv);
+/// @brief Does what @p options say, printing to @p out
+/// @param parsedFiles where to find files parsed before and keep the ones
+///   parsed now, or null to parse every file
+/// @return the exit code
+int execute(Options& options, FILE* out, iron::ParsedFiles* parsedFiles)
+{
+  if (options.cacheStats)
+  {
+    if (options.cacheDir.empty())
+    {
+      iron::errorln("--cache-stats needs a cache, given by --cache or IRON_CACHE.");
+      return -1;
+    }
+    iron::CacheStats stats;
+    if (!iron::Cache{options.cacheDir}.stats(stats)) { return -1; }
+    const auto lookups = stats.hits + stats.misses;
+    const auto hitRate = (lookups == 0) ? size_t(0) : size_t(stats.hits * 100 / lookups);
+    iron::println(out, "Hits: ", size_t(stats.hits), ", misses: ", size_t(stats.misses),
+      " (", hitRate, "% hit)");
+    iron::println(out, "Entries: ", stats.entries, ", ", size_t(stats.bytes), " bytes");
+    return 0;
+  }
 
   if (options.ins.empty())
   {
     iron::errorln("The Iron compiler needs a file name to operate on.");
     return -1;
   }
-  else if (options.ins.size() > 1)
+
+  if (options.watch)
   {
-    iron::errorln("The Iron compiler can only handle one input file at this time.");
-    return -1;
+    return watch(options) ? 0 : -1;
   }
 
-  auto file = std::make_shared<File>(options.ins.front());
-  auto tokens = tokenize(file);
-  if (tokens.isEmpty()) { return -1; }
+  iron::CompilerSession session{options.session};
+  if (options.ins.size() > 1)
+  {
+    if (options.run)
+    {
+      iron::errorln("--run takes a single input file.");
+      return -1;
+    }
+    if (!session.compileFiles(options.ins, options.out)) { return -1; }
+    iron::println(out, "Thanks for using Iron!");
+    return 0;
+  }
 
-  auto ast = makeAst(file, tokens.all());
-  if (!ast) { return -1; }
+  const auto& path = options.ins.front();
+  if (options.run)
+  {
+    int exitCode = 0;
+    return session.run(path, exitCode) ? exitCode : -1;
+  }
 
-  iron::generate(ast, options.out);
+  // A hit skips lexing, parsing and generating. What is compiled is stored
+  // under the hash of the very bytes that were compiled, so an editor that
+  // saves the file meanwhile cannot put its output under the old source.
+  iron::Cache cache{options.cacheDir, options.cacheLimit};
+  const bool isCached = !options.cacheDir.empty() && !options.out.empty() && cache.open();
+  Shared<File> file;
+  if (isCached)
+  {
+    // Read rather than mapped, so the bytes cannot change after they are hashed
+    static const bool MAY_MAP = false;
+    file = std::make_shared<File>(path, MAY_MAP);
+    if (file->isOpen() && !file->isEmpty() &&
+      cache.fetch(iron::cacheKey(file->all(), options.settings()), options.out))
+    {
+      iron::println(out, "Thanks for using Iron!");
+      return 0;
+    }
+  }
 
-  iron::println(stdout, "Thanks for using Iron!");
+  // Lazily parsed trees are parsed further as code is generated, so they
+  // cannot be shared
+  bool compiled = false;
+  if (parsedFiles != nullptr && !options.session.lazy)
+  {
+    const auto parsed = parsedFiles->parse(path, session);
+    compiled = parsed != nullptr && session.generate(*parsed, options.out);
+    if (compiled) { file = parsed->file; }
+  }
+  else
+  {
+    if (file == nullptr) { file = std::make_shared<File>(path); }
+    compiled = session.compile(file, options.out);
+  }
+  if (!compiled) { return -1; }
+  if (isCached && !file->isEmpty())
+  {
+    cache.store(iron::cacheKey(file->all(), options.settings()), options.out);
+  }
+
+  iron::println(out, "Thanks for using Iron!");
   return 0;
 }
 
+/// @brief Compiles what clients ask for on @p socketPath until killed.
+///
+/// LLVM is set up once, and files that have not changed since they were
+/// last compiled are not parsed again. Each request is compiled on a
+/// thread of its own by a session of its own, which reports straight to
+/// the client's stderr.
+/// @return false after reporting that the socket could not be set up
+bool serve(const String& socketPath)
+{
+  iron::enableThreads();
+  iron::initializeTargets();
+
+  const auto diagnostics = iron::Diagnostics::current();
+  iron::ParsedFiles parsedFiles;
+  std::mutex parseMutex;
+  return iron::serve(socketPath, [&](iron::Request& request)
+  {
+    iron::Diagnostics{diagnostics.info, diagnostics.errors, request.err}.install();
+
+    Options options;
+    {
+      // getopt keeps its state in globals
+      std::lock_guard<std::mutex> lock{parseMutex};
+      Vector<char*> argv{const_cast<char*>("iron")};
+      for (auto& arg : request.args) { argv.push_back(&arg[0]); }
+      argv.push_back(nullptr);
+      optind = 0;
+      options = Options::parse(static_cast<int>(argv.size() - 1), argv.data());
+    }
+    if (!options.isValid) { return -1; }
+    if (options.run)
+    {
+      // The program would run inside the server
+      iron::errorln("--run is not available through the server.");
+      return -1;
+    }
+    if (!options.server.empty() || options.watch)
+    {
+      iron::errorln("Neither --server nor --watch is available through the server.");
+      return -1;
+    }
+
+    // The server's working directory is not the client's
+    auto absolute = [&](String& path)
+    {
+      if (!path.empty() && path.front() != '/') { path = request.cwd + "/" + path; }
+    };
+    for (auto& in : options.ins) { absolute(in); }
+    absolute(options.out);
+    absolute(options.cacheDir);
+
+    options.session.info = diagnostics.info;
+    options.session.errors = diagnostics.errors;
+    options.session.diagnostics = request.err;
+    return execute(options, request.out, &parsedFiles);
+  });
+}
+
+int main(int argc, char* argv[])
+{
+  if (getenv("INFO") != nullptr) { iron::infoOn = true; }
+  if (getenv("SILENT") != nullptr) { iron::errorOn = false; }
+  if (getenv("TRACE") != nullptr) { iron::trace::enable(getenv("TRACE")); }
+
+  auto options = Options::parse(argc, argv);
+  if (!options.isValid) { return -1; }
+  if (!options.server.empty())
+  {
+    return serve(options.server) ? 0 : -1;
+  }
+
+  options.session.info = iron::infoOn;
+  options.session.errors = iron::errorOn;
+  options.session.diagnostics = stderr;
+  return execute(options, stdout, nullptr);
+}
@@ -1,5 +1,268 @@
+// standard includes
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <unistd.h>
+
+// iron includes
 #include "iron/print.h"
 
-bool iron::errorOn = true;
-bool iron::infoOn = false;
+__thread bool iron::errorOn = true;
+__thread bool iron::infoOn = false;
+__thread FILE* iron::errorFile = nullptr;
+
+uint32_t iron::trace::enabled = 0;
+
+namespace
+{
+
+using Category = iron::trace::Category;
+
+struct Event
+{
+  uint64_t time;
+  const char* what;
+  uint64_t args[2];
+  /// @brief The thread that recorded it, which is not the ring's thread
+  ///   when the ring was handed on
+  uint32_t thread;
+  Category category;
+};
+
+/// Must be a power of two
+const size_t RING_SIZE = 1 << 14;
+
+struct Ring
+{
+  Event events[RING_SIZE];
+  /// @brief The number of events ever recorded; the ring keeps the last
+  ///   RING_SIZE of them
+  uint64_t count;
+  uint64_t thread;
+  Ring* next;
+  /// @brief Set when the thread that recorded into the ring exits, so that
+  ///   a new thread can take it over and record after its events
+  std::atomic<bool> isFree;
+};
+
+/// @brief Every thread's ring, newest thread first. Rings are never freed so
+///   that a crash handler can always walk this list. A thread that exits
+///   hands its ring on to the next new thread instead, so a server that
+///   starts a thread per request keeps as many rings as it ever had threads
+///   at once.
+std::atomic<Ring*> rings{nullptr};
+std::atomic<uint64_t> threadCount{0};
+__thread Ring* localRing = nullptr;
+
+/// @brief Frees the ring of its thread when the thread exits
+struct RingOwner
+{
+  Ring* ring = nullptr;
+
+  ~RingOwner()
+  {
+    if (ring != nullptr) { ring->isFree.store(true); }
+  }
+};
+thread_local RingOwner ringOwner;
+
+const uint64_t startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+  std::chrono::steady_clock::now().time_since_epoch()).count();
+
+const char* const CATEGORY_NAMES[] = {"lex", "parse", "codegen"};
+const size_t CATEGORY_COUNT = sizeof(CATEGORY_NAMES) / sizeof(CATEGORY_NAMES[0]);
+
+/// @return a ring for this thread, or null if there is no memory for one
+Ring* makeRing()
+{
+  for (auto ring = rings.load(); ring != nullptr; ring = ring->next)
+  {
+    bool isFree = true;
+    if (ring->isFree.compare_exchange_strong(isFree, false))
+    {
+      ring->thread = threadCount++;
+      return ring;
+    }
+  }
+
+  auto ring = static_cast<Ring*>(calloc(1, sizeof(Ring)));
+  if (ring == nullptr) { return nullptr; }
+  ring->thread = threadCount++;
+  ring->next = rings.load();
+  while (!rings.compare_exchange_weak(ring->next, ring)) {}
+  return ring;
+}
+
+/// @brief Formatting for the dump. Only async-signal-safe calls are made.
+class Writer
+{
+private :
+  char _buffer[256];
+  size_t _size;
+  int _fd;
+
+public :
+  explicit Writer(int fd) : _size(0), _fd(fd) {}
+
+  Writer& operator<<(const char* str)
+  {
+    while (*str != '\0')
+    {
+      if (_size == sizeof(_buffer)) { flush(); }
+      _buffer[_size++] = *str++;
+    }
+    return *this;
+  }
+
+  Writer& operator<<(char c)
+  {
+    if (_size == sizeof(_buffer)) { flush(); }
+    _buffer[_size++] = c;
+    return *this;
+  }
+
+  Writer& operator<<(uint64_t number)
+  {
+    char digits[24];
+    size_t count = 0;
+    do
+    {
+      digits[count++] = '0' + (number % 10);
+      number /= 10;
+    } while (number != 0);
+
+    while (count > 0)
+    {
+      if (_size == sizeof(_buffer)) { flush(); }
+      _buffer[_size++] = digits[--count];
+    }
+    return *this;
+  }
+
+  void flush()
+  {
+    size_t done = 0;
+    while (done < _size)
+    {
+      const auto count = write(_fd, _buffer + done, _size - done);
+      if (count <= 0) { break; }
+      done += static_cast<size_t>(count);
+    }
+    _size = 0;
+  }
+};
+
+void dumpAtExit()
+{
+  iron::trace::dump(STDERR_FILENO);
+}
+
+void dumpOnSignal(int signal)
+{
+  iron::trace::dump(STDERR_FILENO);
+  // The handler was installed with SA_RESETHAND, so this is fatal now.
+  raise(signal);
+}
+
+} // namespace
+
+bool iron::trace::enable(const char* categories)
+{
+  bool ok = true;
+  while (*categories != '\0')
+  {
+    const char* end = strchr(categories, ',');
+    const size_t size = (end != nullptr) ? size_t(end - categories) : strlen(categories);
+
+    bool found = false;
+    if (size == 3 && strncmp(categories, "all", size) == 0)
+    {
+      enabled = ~0u;
+      found = true;
+    }
+    for (size_t i=0; i<CATEGORY_COUNT && !found; ++i)
+    {
+      if (strlen(CATEGORY_NAMES[i]) == size &&
+          strncmp(categories, CATEGORY_NAMES[i], size) == 0)
+      {
+        enabled |= 1u << i;
+        found = true;
+      }
+    }
+    if (!found)
+    {
+      errorln("Unknown trace category: ", std::string{categories, size});
+      ok = false;
+    }
+
+    categories += size;
+    if (*categories == ',') { ++categories; }
+  }
+
+  static bool isInstalled = false;
+  if (enabled != 0 && !isInstalled)
+  {
+    isInstalled = true;
+    atexit(dumpAtExit);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpOnSignal;
+    action.sa_flags = SA_RESETHAND;
+    for (int signal : {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV})
+    {
+      sigaction(signal, &action, nullptr);
+    }
+  }
+
+  return ok;
+}
+
+void iron::trace::record(Category category, const char* what, uint64_t arg0,
+  uint64_t arg1)
+{
+  if (localRing == nullptr)
+  {
+    // Without memory for a ring, this thread's events are dropped
+    localRing = makeRing();
+    if (localRing == nullptr) { return; }
+    ringOwner.ring = localRing;
+  }
+
+  const uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  auto& event = localRing->events[localRing->count & (RING_SIZE - 1)];
+  event.time = now - startTime;
+  event.what = what;
+  event.args[0] = arg0;
+  event.args[1] = arg1;
+  event.thread = static_cast<uint32_t>(localRing->thread);
+  event.category = category;
+  ++localRing->count;
+}
 
+void iron::trace::dump(int fd)
+{
+  Writer out{fd};
+  for (auto ring = rings.load(); ring != nullptr; ring = ring->next)
+  {
+    const uint64_t count = ring->count;
+    const uint64_t first = (count > RING_SIZE) ? (count - RING_SIZE) : 0;
+    out << "== trace of thread " << ring->thread << ": " << count
+      << " events, " << first << " overwritten\n";
+    for (uint64_t i=first; i<count; ++i)
+    {
+      const auto& event = ring->events[i & (RING_SIZE - 1)];
+      const auto category = static_cast<size_t>(event.category);
+      out << event.time << "ns "
+        << ((category < CATEGORY_COUNT) ? CATEGORY_NAMES[category] : "?")
+        << ' ' << event.what << ' ' << event.args[0] << ' ' << event.args[1];
+      if (event.thread != ring->thread) { out << " (thread " << uint64_t(event.thread) << ')'; }
+      out << "\n";
+    }
+  }
+  out.flush();
+}